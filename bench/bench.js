@@ -0,0 +1,402 @@
+// Benchmarks for the binding, run with `node bench/bench.js [options]`:
+//
+//   --requests=N          requests per run (default 10000)
+//   --concurrency=1,100   concurrency levels for the request rate runs
+//   --filter=regex        only runs whose name matches
+//   --target=host:port    use a server started elsewhere with --serve
+//   --serve               only run the server, on --port (default 4242)
+//   --gc                  count the collections during each small-cN run
+//
+// Results go to stdout, one JSON object per line; start node with
+// --expose-gc to get heap numbers after a full collection. --gc runs the
+// benchmarks in a child node started with --trace-gc and counts its trace
+// lines, the embedded server's collections are included unless --target is
+// used. The 10000 concurrency run needs `ulimit -n` well above 20000 with
+// the embedded server, half that with --target.
+
+var http = require('http');
+var spawn = require('child_process').spawn;
+var curl = require('../build/default/curl');
+
+// import symbols into the global namespace
+for (var k in curl) {
+	global[k] = curl[k];
+}
+
+var options = {
+	requests: 10000,
+	concurrency: [1, 100, 10000],
+	filter: null,
+	target: null,
+	serve: false,
+	port: 4242,
+	gc: false,
+	gcmarks: false // set for the child of --gc
+};
+
+process.argv.slice(2).forEach(function(arg) {
+	var m = /^--([a-z]+)(?:=(.*))?$/.exec(arg);
+	if (!m) {
+		throw new Error('Bad argument: ' + arg);
+	}
+	switch (m[1]) {
+	case 'requests': options.requests = parseInt(m[2], 10); break;
+	case 'concurrency': options.concurrency = m[2].split(',').map(Number); break;
+	case 'filter': options.filter = new RegExp(m[2]); break;
+	case 'target': options.target = m[2]; break;
+	case 'serve': options.serve = true; break;
+	case 'port': options.port = parseInt(m[2], 10); break;
+	case 'gc': options.gc = true; break;
+	case 'gcmarks': options.gcmarks = true; break;
+	default: throw new Error('Unknown option: ' + arg);
+	}
+});
+
+//
+// server
+//
+// /small    a short JSON body
+// /large/N  N bytes in 64 KB writes
+// /chunks/N N writes of 16 bytes each, chunked
+//
+var small = new Buffer('{"ok":true,"id":12345,"name":"node-curl"}');
+var block = new Buffer(64 * 1024);
+for (var i = 0; i < block.length; ++i) {
+	block[i] = i & 0xff;
+}
+var chunk = new Buffer('0123456789abcdef');
+
+function serve(req, res) {
+	var m;
+
+	if (req.url == '/small') {
+		res.writeHead(200, { 'Content-Type': 'application/json', 'Content-Length': small.length });
+		res.end(small);
+	}
+	else if ((m = /^\/large\/(\d+)$/.exec(req.url))) {
+		var left = parseInt(m[1], 10);
+		res.writeHead(200, { 'Content-Type': 'application/octet-stream', 'Content-Length': left });
+		(function write() {
+			while (left > 0) {
+				var n = Math.min(left, block.length);
+				left -= n;
+				if (!res.write(n == block.length ? block : block.slice(0, n))) {
+					res.once('drain', write);
+					return;
+				}
+			}
+			res.end();
+		})();
+	}
+	else if ((m = /^\/chunks\/(\d+)$/.exec(req.url))) {
+		var count = parseInt(m[1], 10);
+		res.writeHead(200, { 'Content-Type': 'text/plain' });
+		(function write() {
+			while (count-- > 0) {
+				if (!res.write(chunk)) {
+					res.once('drain', write);
+					return;
+				}
+			}
+			res.end();
+		})();
+	}
+	else {
+		res.writeHead(404);
+		res.end();
+	}
+}
+
+//
+// helpers
+//
+function now() {
+	return Date.now() / 1000;
+}
+
+function memory() {
+	if (typeof gc == 'function') {
+		gc();
+	}
+	return process.memoryUsage();
+}
+
+function report(result) {
+	console.log(JSON.stringify(result));
+}
+
+// brackets a measured run in the --trace-gc output of a --gc child
+function gcMark(what, bench) {
+	if (options.gcmarks) {
+		console.log('#gc ' + what + ' ' + bench);
+	}
+}
+
+// reruns the benchmarks with --trace-gc and passes their results on, those
+// that were bracketed by gcMark() with the collections counted
+function traceGC() {
+	var args = ['--trace-gc', __filename, '--gcmarks'].concat(process.argv.slice(2).filter(function(arg) {
+		return arg != '--gc';
+	}));
+	var child = spawn(process.execPath, args);
+	var pending = '', counts = {}, current = null;
+
+	function line(text) {
+		var m = /^#gc (start|end) (\S+)$/.exec(text);
+		if (m) {
+			if (m[1] == 'start') {
+				current = counts[m[2]] = { scavenges: 0, mark_sweeps: 0 };
+			}
+			else {
+				current = null;
+			}
+		}
+		else if (text.charAt(0) == '{') {
+			var result = JSON.parse(text);
+			var gc = counts[result.bench];
+			if (gc) {
+				result.gc_scavenges = gc.scavenges;
+				result.gc_mark_sweeps = gc.mark_sweeps;
+			}
+			report(result);
+		}
+		else if (current) {
+			if (/Scavenge/.test(text)) {
+				++current.scavenges;
+			}
+			else if (/Mark-(sweep|compact)/.test(text)) {
+				++current.mark_sweeps;
+			}
+		}
+	}
+
+	child.stdout.on('data', function(data) {
+		var lines = (pending + data).split('\n');
+		pending = lines.pop();
+		lines.forEach(line);
+	});
+	child.stderr.on('data', function(data) {
+		process.stderr.write(data);
+	});
+	child.on('exit', function(code) {
+		if (pending) {
+			line(pending);
+		}
+		process.exit(code);
+	});
+}
+
+// issues `total` GETs with at most `concurrency` in flight, `setup` prepares
+// each handle; calls back with the elapsed time and the number of failures
+function run(url, total, concurrency, setup, callback) {
+	var started = 0, finished = 0, failed = 0;
+	var start = now();
+
+	function next(ch) {
+		if (started == total) {
+			return;
+		}
+		++started;
+
+		curl_easy_reset(ch);
+		curl_easy_setopt(ch, CURLOPT_URL, url);
+		setup(ch);
+
+		curl_easy_perform(ch, function(ex) {
+			if (ex) {
+				++failed;
+			}
+			if (++finished == total) {
+				callback(now() - start, failed);
+			}
+			else {
+				next(ch);
+			}
+		});
+	}
+
+	for (var i = 0; i < Math.min(concurrency, total); ++i) {
+		next(curl_easy_init());
+	}
+}
+
+//
+// benchmarks, each calls `done` when it's finished
+//
+var benchmarks = [];
+
+// request rate for small responses, and the per-wakeup cost of the multi
+// loop as concurrency grows, that should stay flat
+options.concurrency.forEach(function(concurrency) {
+	benchmarks.push({
+		name: 'small-c' + concurrency,
+		fn: function(base, done) {
+			var total = options.requests;
+			var before = memory();
+			curl_multi_stats(undefined, true);
+			gcMark('start', 'small-c' + concurrency);
+
+			run(base + '/small', total, concurrency, function(ch) {
+				curl_easy_setopt(ch, NODECURLOPT_ACCUMULATE, 1);
+			}, function(seconds, failed) {
+				gcMark('end', 'small-c' + concurrency);
+				var after = memory();
+				var stats = curl_multi_stats(undefined, true);
+				var perMillion = 1e6 / total;
+
+				report({
+					bench: 'small-c' + concurrency,
+					requests: total,
+					concurrency: concurrency,
+					failed: failed,
+					seconds: seconds,
+					rps: total / seconds,
+					wakeups: stats.wakeups,
+					ns_per_wakeup: stats.processTimeNs.count ? stats.processTimeNs.sum / stats.processTimeNs.count : 0,
+					reuse_ratio: stats.reuseRatio,
+					rss_per_million: (after.rss - before.rss) * perMillion,
+					heap_per_million: (after.heapUsed - before.heapUsed) * perMillion
+				});
+				done();
+			});
+		}
+	});
+});
+
+// throughput for large bodies in each of the write modes
+[
+	{ mode: 'callback', setup: function(ch) {
+		curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, function() {});
+	} },
+	{ mode: 'writebuffer', setup: function(ch) {
+		curl_easy_setopt(ch, NODECURLOPT_WRITEBUFFER, 256 * 1024);
+		curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, function() {});
+	} },
+	{ mode: 'accumulate', setup: function(ch) {
+		curl_easy_setopt(ch, NODECURLOPT_ACCUMULATE, 1);
+	} },
+	{ mode: 'file', setup: function(ch) {
+		curl_easy_setopt(ch, NODECURLOPT_WRITEFILE, '/dev/null');
+	} }
+].forEach(function(variant) {
+	benchmarks.push({
+		name: 'large-' + variant.mode,
+		fn: function(base, done) {
+			var size = 64 * 1024 * 1024, total = 16;
+
+			run(base + '/large/' + size, total, 4, variant.setup, function(seconds, failed) {
+				report({
+					bench: 'large-' + variant.mode,
+					requests: total,
+					failed: failed,
+					seconds: seconds,
+					mb_per_second: size * total / (1024 * 1024) / seconds
+				});
+				done();
+			});
+		}
+	});
+});
+
+// the cost of a single write callback, with and without coalescing
+[0, 64 * 1024].forEach(function(highwatermark) {
+	benchmarks.push({
+		name: 'chunks-hwm' + highwatermark,
+		fn: function(base, done) {
+			var count = 100000, total = 10, calls = 0;
+
+			run(base + '/chunks/' + count, total, 1, function(ch) {
+				curl_easy_setopt(ch, NODECURLOPT_WRITE_HIGHWATERMARK, highwatermark);
+				curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, function() {
+					++calls;
+				});
+			}, function(seconds, failed) {
+				report({
+					bench: 'chunks-hwm' + highwatermark,
+					requests: total,
+					failed: failed,
+					seconds: seconds,
+					callbacks: calls,
+					us_per_callback: calls ? seconds * 1e6 / calls : 0
+				});
+				done();
+			});
+		}
+	});
+});
+
+// the cost of setting options, one call per option versus one for all
+[false, true].forEach(function(batched) {
+	var name = batched ? 'setopt-array' : 'setopt';
+	benchmarks.push({
+		name: name,
+		fn: function(base, done) {
+			var ch = curl_easy_init(), total = 100000;
+			var opts = [
+				CURLOPT_URL, base + '/small',
+				CURLOPT_USERAGENT, 'node-curl-bench',
+				CURLOPT_FOLLOWLOCATION, 1,
+				CURLOPT_TIMEOUT, 30,
+				CURLOPT_HTTPHEADER, ['Accept: application/json']
+			];
+			var start = now();
+
+			for (var i = 0; i < total; ++i) {
+				if (batched) {
+					curl_easy_setopt_array(ch, opts);
+				}
+				else {
+					for (var j = 0; j < opts.length; j += 2) {
+						curl_easy_setopt(ch, opts[j], opts[j + 1]);
+					}
+				}
+			}
+
+			var seconds = now() - start;
+			report({
+				bench: name,
+				calls: total,
+				seconds: seconds,
+				ns_per_handle: seconds * 1e9 / total
+			});
+			done();
+		}
+	});
+});
+
+function runAll(base, callback) {
+	var queue = benchmarks.filter(function(b) {
+		return !options.filter || options.filter.test(b.name);
+	});
+
+	(function next() {
+		var b = queue.shift();
+		if (b) {
+			b.fn(base, function() {
+				process.nextTick(next);
+			});
+		}
+		else {
+			callback();
+		}
+	})();
+}
+
+var server = http.createServer(serve);
+
+if (options.gc) {
+	traceGC();
+}
+else if (options.serve) {
+	server.listen(options.port);
+}
+else if (options.target) {
+	runAll('http://' + options.target, function() {});
+}
+else {
+	server.listen(options.port, '127.0.0.1', function() {
+		runAll('http://127.0.0.1:' + options.port, function() {
+			server.close();
+		});
+	});
+}
@@ -0,0 +1,16 @@
+#!/bin/sh
+# Builds an instrumented binding, trains it with the benchmark suite and
+# rebuilds it with the recorded profile. Extra arguments are passed on to
+# `node-waf configure`, e.g. --profile=lto.
+set -e
+
+cd "$(dirname "$0")/.."
+
+find build -name '*.gcda' -exec rm -f {} + 2>/dev/null || true
+
+node-waf configure --pgo=generate "$@"
+node-waf build
+node bench/bench.js --requests=20000 --concurrency=1,100 > /dev/null
+
+node-waf configure --pgo=use "$@"
+node-waf build
@@ -1,7 +1,23 @@
+#include <cstdarg>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
+#include <cctype>
+#include <algorithm>
+#include <deque>
 #include <map>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
 
 #include <curl/curl.h>
 
@@ -14,7 +30,39 @@ using namespace node;
 
 namespace {
 
+// node-curl specific options, numbered well clear of libcurl's CURLOPT_* range
+enum {
+	NODECURLOPT_WRITEBUFFER = 1000000,
+	NODECURLOPT_WRITE_HIGHWATERMARK,
+	NODECURLOPT_WRITE_MAXDELAY,
+	NODECURLOPT_ACCUMULATE,
+	NODECURLOPT_UPLOADSTREAM,
+	NODECURLOPT_WRITEFILE,
+	NODECURLOPT_WRITEFILE_OFFSET,
+	NODECURLOPT_HEADERS,
+	NODECURLOPT_PRIORITY,
+	NODECURLOPT_DNS_CACHE,
+	NODECURLOPT_PROGRESS,
+	NODECURLOPT_AUTOCLOSE,
+};
+
+// same for the multi handle's CURLMOPT_*
+enum {
+	NODECURLMOPT_MAX_INFLIGHT = 1000000,
+	NODECURLMOPT_MAX_HOST_INFLIGHT,
+	NODECURLMOPT_HOST_RATE,
+	NODECURLMOPT_HOST_BURST,
+	NODECURLMOPT_PRIORITY_WEIGHTS,
+};
+
+// priority levels for NODECURLOPT_PRIORITY, 0 is the most important one
+enum { PRIORITY_LEVELS = 4, PRIORITY_DEFAULT = 1 };
+
 Persistent<ObjectTemplate> easyHandleTemplate;
+Persistent<ObjectTemplate> shareHandleTemplate;
+Persistent<ObjectTemplate> multiHandleTemplate;
+Persistent<ObjectTemplate> workerPoolTemplate;
+Persistent<ObjectTemplate> headersTemplate;
 
 Handle<Value> Error(const char* message) {
 	return ThrowException(
@@ -38,48 +86,506 @@ template <> Handle<Value> CurlError<CURLMcode>(CURLMcode status) {
 	return Error(curl_multi_strerror(status));
 }
 
+template <> Handle<Value> CurlError<CURLSHcode>(CURLSHcode status) {
+	return Error(curl_share_strerror(status));
+}
+
+//
+// tracing
+//
+// Compiled out unless NODE_CURL_TRACE is defined (`node-waf configure --trace`).
+// Events go into a fixed-size in-memory ring, slots are claimed with an atomic
+// increment so the worker threads can trace too. curl_trace_dump() returns
+// the ring's contents, oldest first.
+//
+#ifdef NODE_CURL_TRACE
+
+#define TRACE(...) Trace(__VA_ARGS__)
+
+enum { TRACE_SLOTS = 4096, TRACE_SLOT_SIZE = 128 };
+
+char trace_ring[TRACE_SLOTS][TRACE_SLOT_SIZE];
+volatile unsigned trace_next;
+
+void Trace(const char* format, ...) {
+	char* slot = trace_ring[__sync_fetch_and_add(&trace_next, 1) % TRACE_SLOTS];
+
+	const int n = snprintf(slot, TRACE_SLOT_SIZE, "%.6f ", ev_time());
+
+	va_list ap;
+	va_start(ap, format);
+	vsnprintf(slot + n, TRACE_SLOT_SIZE - n, format, ap);
+	va_end(ap);
+}
+
+Handle<Array> TraceToArray() {
+	const unsigned next = trace_next;
+	const unsigned first = next > TRACE_SLOTS ? next - TRACE_SLOTS : 0;
+
+	Local<Array> array = Array::New(next - first);
+
+	for (unsigned i = first; i < next; ++i) {
+		array->Set(i - first, String::New(trace_ring[i % TRACE_SLOTS]));
+	}
+
+	return array;
+}
+
+#else
+
+// unevaluated, keeps the arguments "used" and format-checked
+#define TRACE(...) ((void) sizeof(printf(__VA_ARGS__)))
+
+Handle<Array> TraceToArray() {
+	return Array::New(0);
+}
+
+#endif
+
+//
+// statistics
+//
+// Cheap enough for the hot path: plain increments and a bucket per power
+// of two, bucket i holds the values in [2^(i-1), 2^i).
+//
+struct Histogram {
+	enum { BUCKETS = 40 };
+
+	Histogram() {
+		Clear();
+	}
+
+	void Add(uint64_t value) {
+		unsigned i = value ? 64 - __builtin_clzll(value) : 0;
+		++buckets[i < BUCKETS ? i : BUCKETS - 1];
+		++count;
+		sum += value;
+		max = std::max(max, value);
+	}
+
+	void Clear() {
+		memset(this, 0, sizeof(*this));
+	}
+
+	Handle<Object> ToObject() const;
+
+	uint64_t buckets[BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+};
+
+Handle<Object> Histogram::ToObject() const {
+	Local<Object> o = Object::New();
+
+	// trailing empty buckets are left out
+	unsigned n = BUCKETS;
+	while (n > 0 && buckets[n - 1] == 0) {
+		--n;
+	}
+
+	Local<Array> a = Array::New(n);
+	for (unsigned i = 0; i < n; ++i) {
+		a->Set(i, Number::New(buckets[i]));
+	}
+
+	o->Set(String::NewSymbol("count"), Number::New(count));
+	o->Set(String::NewSymbol("sum"), Number::New(sum));
+	o->Set(String::NewSymbol("max"), Number::New(max));
+	o->Set(String::NewSymbol("buckets"), a);
+
+	return o;
+}
+
+uint64_t MonotonicNanos() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// Arena definition
+//
+// Bump allocator for a handle's request-scoped data. Nothing is freed
+// until Reset(), which rewinds it and keeps the memory; when it took more
+// than one block it's replaced by a single block the size of all of them
+// so the next request doesn't allocate at all.
+//
+class Arena {
+public:
+	Arena();
+	~Arena();
+	void* Alloc(size_t size);
+	bool Contains(const void* p) const;
+	void Reset();
+	void FreeBlocks();
+
+private:
+	struct Block {
+		Block* prev;
+		size_t size;
+		char* Data() { return reinterpret_cast<char*>(this + 1); }
+	};
+
+	enum { BLOCK_SIZE = 4096 - sizeof(Block), ALIGN = sizeof(void*) };
+
+	Block* head_; // the one being filled
+	size_t used_; // of head_
+
+	// not copyable
+	Arena(const Arena&);
+	Arena& operator=(const Arena&);
+};
+
+//
+// Headers definition
+//
+// The response headers are parsed natively as they come in, no V8 involved
+// so this works on the worker threads too. Names are lowercased, values are
+// trimmed, both live in a single string. Only the headers of the last
+// response are kept, those of redirects and 100 Continue are dropped.
+struct HeaderArena {
+	struct Entry {
+		unsigned name;
+		unsigned name_len;
+		unsigned value;
+		unsigned value_len;
+	};
+
+	HeaderArena();
+
+	void Parse(const char* line, size_t size);
+	const char* Find(const char* name, size_t* len) const;
+	void Clear();
+	void Swap(HeaderArena& other);
+
+	std::string buf;
+	std::vector<Entry> entries;
+	int status;
+};
+
+// JS view on a HeaderArena, a header is turned into a string when it is read;
+// `headers[':status']` is the status code
+class Headers: public ObjectWrap {
+public:
+	static Handle<Object> New(HeaderArena& arena);
+
+	static Handle<Value> Getter(Local<String> property, const AccessorInfo& info);
+	static Handle<Integer> Query(Local<String> property, const AccessorInfo& info);
+	static Handle<Array> Enumerator(const AccessorInfo& info);
+
+private:
+	Handle<Value> Get(const char* name, size_t len);
+
+	HeaderArena arena_;
+};
+
 //
 // EasyHandle definition
 //
+struct HostQueue;
+
 class EasyHandle: public ObjectWrap {
 public:
+	// called instead of the JS completion callback, for transfers driven from C++
+	typedef void (*CompleteHook)(EasyHandle* ch, CURLcode result, curl_off_t size, void* data);
+
 	static Handle<Object> New();
 	static bool IsInstanceOf(Handle<Value> val);
 	static EasyHandle* Unwrap(Handle<Value> handle);
+	static EasyHandle* FromCURL(CURL* ch);
+	static void SetPoolSize(size_t size);
 
+	void SetReadCallback(Handle<Value> callback);
+	void SetUploadStream(bool upload_stream);
+	bool IsUploadStream();
+	size_t QueueUpload(Handle<Value> data);
+	size_t Read(char* data, size_t size);
 	void SetWriteCallback(Handle<Value> callback);
-	Handle<Value> InvokeWriteCallback(Buffer* data);
+	void SetWriteBuffer(Handle<Object> buffer);
+	void SetWriteHighWaterMark(size_t highwatermark);
+	void SetWriteMaxDelay(long max_delay_ms);
+	void SetAccumulate(bool accumulate);
+	void SetCaptureHeaders(bool capture);
+	void ParseHeader(const char* data, size_t size);
+	bool SetWriteFile(const char* path);
+	bool SetWriteFile(int fd);
+	void SetWriteFileOffset(curl_off_t offset);
+	void SetExpectedRange(curl_off_t start, bool whole);
+	CURLcode FinishWriteFile(CURLcode result);
+	size_t Write(const char* data, size_t size);
+	CURLcode Pause(int bitmask);
+	void FlushWrites();
+	Handle<Value> InvokeWriteCallback(const char* data, size_t size);
+	void SetCompleteCallback(Handle<Value> callback);
+	void SetCompleteHook(CompleteHook hook, void* data);
+	void InvokeCompleteCallback(CURLcode result);
+	const HeaderArena& GetHeaders();
+	void SetShare(Handle<Object> share);
+	void SetStreamDepends(Handle<Object> parent);
+	void SetSList(CURLoption option, curl_slist* slist);
+	CURLcode SetPostFields(const char* data, size_t size);
+	void SetInFlight(bool in_flight);
+	bool IsInFlight();
+	void SetHost(const char* url);
+	void SetPriority(int priority);
+	void SetUseDnsCache(bool use);
+	void RestoreResolve();
+	void ApplyDnsCache();
+	void PrepareTransfer();
+	void SetProgress(bool progress);
+	void UpdateProgress(double dltotal, double dlnow, double ultotal, double ulnow);
+	const char* ToUtf8(Handle<Value> value, size_t* length = NULL);
+	curl_slist* NewSList(CURLoption option, Handle<Array> array);
+	void Pin();
+	void Unpin();
+	void Reset();
+	void Close();
+	bool IsClosed();
+	void SetAutoClose(bool auto_close);
+	bool CanRunOffThread();
+	bool IsOffThread();
+	bool HasDependents();
 	operator CURL*();
 	virtual ~EasyHandle();
 
 private:
-	CURL* const ch_;
+	friend class MultiHandle;
+	friend class Progress;
+	friend class WorkerPool;
+	typedef std::vector<CURL*> Pool;
+	typedef std::vector<std::pair<CURLoption, curl_slist*> > SLists;
+	typedef std::deque<Persistent<Object> > Uploads;
+
+	CURL* ch_;             // NULL once closed
+	bool in_flight_;
+	bool in_multi_;        // added to a multi handle's libcurl handle
+	bool queued_;          // waiting in a multi handle's scheduler
+	bool off_thread_;      // in flight on a WorkerPool
+	bool auto_close_;
+	EasyHandle* next_job_; // intrusive link for WorkerPool's job queues
+	CURLcode result_;
+	std::string host_;      // host:port of CURLOPT_URL, what the scheduler goes by
+	int priority_;
+	bool use_dns_cache_;
+	bool progress_;          // NODECURLOPT_PROGRESS
+	bool progress_watched_;  // registered with Progress
+	size_t progress_index_;  // into Progress::handles_
+	// written by whichever thread runs the transfer, read by the progress timer
+	// without a lock: a report can mix values of two updates (or, where doubles
+	// aren't written in one go, show a torn one) and an update can be reported
+	// late, the next one puts it right
+	volatile bool progress_dirty_;
+	volatile double progress_values_[4]; // dlnow, dltotal, ulnow, ultotal
+	HostQueue* host_queue_; // set by the scheduler while the transfer counts against a host
 	Persistent<Function> read_callback_;
+	bool upload_stream_;
+	Uploads uploads_;      // queued Buffers, not copied
+	size_t upload_offset_; // into uploads_.front()
+	size_t upload_queued_; // bytes
+	bool upload_ended_;
+	bool upload_paused_;
+	int pause_state_; // CURLPAUSE_* bits
 	Persistent<Function> write_callback_;
+	Persistent<Function> complete_callback_;
+	CompleteHook complete_hook_;
+	void* complete_hook_data_;
+	Persistent<Object> write_buffer_;
+	size_t write_offset_;
+	std::vector<char> pending_writes_;
+	size_t write_highwatermark_;
+	long write_max_delay_ms_;
+	ev_timer flush_timer_;
+	bool accumulate_;
+	char* body_;
+	size_t body_size_;
+	size_t body_capacity_;
+	bool capture_headers_;
+	HeaderArena headers_;
+	int file_fd_;
+	bool file_owned_;        // opened from file_path_, closed when the transfer is done
+	std::string file_path_;
+	curl_off_t file_start_;  // where the body goes in the file
+	curl_off_t file_pos_;    // where file_buf_ goes in the file
+	char* file_buf_;         // staging area, written out in FILE_BUF_SIZE batches
+	size_t file_buf_used_;
+	bool file_error_;
+	bool file_finished_;
+	curl_off_t range_start_; // -1, or the Content-Range start the body must have
+	bool range_whole_;       // a 2xx with the whole body will do too
+	bool range_checked_;
+	Persistent<Object> share_;
+	Persistent<Object> stream_depends_;
+	unsigned dependents_;  // handles whose stream depends on this one
+	SLists slists_;        // lists from the arena aren't freed one by one
+	std::vector<char> post_fields_;
+	Arena arena_;          // slists, until Reset()
+	std::vector<char> utf8_; // scratch space for ToUtf8()
 
 	EasyHandle();
+	void FreeSLists();
+	void DetachStreamDepends();
+	void ClearUploads();
+	bool WriteFile(const char* data, size_t size);
+	bool CheckRange();
+	bool FlushWriteFile();
+	void CloseWriteFile();
+	bool AppendBody(const char* data, size_t size);
+	Handle<Value> TakeBody();
+	void ClearBody();
+
+	static void FlushTimerFunction(ev_timer* w, int events);
+	static void FreeBody(char* data, void* hint);
+	static CURL* AcquireCURL();
+	static void ReleaseCURL(CURL* ch, bool reset = true);
+
+	static Pool pool_;
+	static size_t pool_size_;
+
+	enum { FILE_BUF_SIZE = 256 * 1024, FILE_BUF_ALIGN = 4096, BODY_PRESIZE_MAX = 8 * 1024 * 1024 };
+};
+
+typedef std::vector<EasyHandle*> EasyHandles;
+
+bool HasDuplicates(EasyHandles handles);
+size_t BodyFunction(char* data, size_t size, size_t nmemb, void* arg);
+
+//
+// ShareHandle definition
+//
+class ShareHandle: public ObjectWrap {
+public:
+	static Handle<Object> New();
+	static bool IsInstanceOf(Handle<Value> val);
+	static ShareHandle* Unwrap(Handle<Value> handle);
+
+	operator CURLSH*();
+	virtual ~ShareHandle();
+
+private:
+	CURLSH* const sh_;
+
+	ShareHandle();
 };
 
 //
 // MultiHandle definition
 //
-class MultiHandle {
+// the scheduler's bookkeeping for one host
+struct HostQueue {
+	explicit HostQueue(const std::string& name);
+	void Refill(double now, double rate, double burst);
+
+	std::string name;
+	unsigned in_flight;
+	unsigned num_pending;
+	double tokens;   // token bucket for the rate limit
+	double refilled; // when tokens was last brought up to date
+	std::deque<EasyHandle*> pending[PRIORITY_LEVELS];
+};
+
+class MultiHandle: public ObjectWrap {
 public:
+	static Handle<Object> New();
+	static bool IsInstanceOf(Handle<Value> val);
+	static MultiHandle* Unwrap(Handle<Value> handle);
 	static bool Initialize();
 	static MultiHandle& Singleton();
 	Handle<Value> Add(EasyHandle& ch);
+	Handle<Value> AddMany(const EasyHandles& handles);
+	void Abort(EasyHandle& ch);
+	Handle<Object> Stats(bool clear);
+	void SetMaxInFlight(unsigned max);
+	void SetMaxHostInFlight(unsigned max);
+	void SetHostRate(double rate);
+	void SetHostBurst(double burst);
+	void SetPriorityWeights(const unsigned* weights);
+	operator CURLM*();
+	virtual ~MultiHandle();
 
 private:
-	typedef std::map<curl_socket_t, ev_io> SockFDs;
+	// watchers are indexed by fd and recycled through a free list, they're
+	// carved out of blocks that live as long as the multi handle
+	typedef std::vector<ev_io*> Watchers;
+	enum { WATCHER_BLOCK_SIZE = 64, SWEEP_MIN = 64 };
+
+	struct Completion {
+		EasyHandle* ch;
+		CURLcode result;
+	};
+	typedef std::vector<Completion> Completions;
 
+	// the counters are totals since the last Stats(true)
+	struct Statistics {
+		Statistics();
+
+		int running_handles;        // as of the last curl_multi_socket_action()
+		unsigned sockets;
+		unsigned max_sockets;
+		uint64_t wakeups;           // ProcessEvents() calls
+		uint64_t socket_events;
+		uint64_t timer_events;
+		uint64_t transfers;
+		uint64_t failed_transfers;
+		uint64_t connections;       // transfers that opened at least one connection
+		uint64_t bytes_in;          // headers and bodies
+		uint64_t bytes_out;
+		Histogram completions;      // completed transfers per wakeup
+		Histogram process_time_ns;  // time spent in ProcessEvents()
+		Histogram transfer_time_us; // CURLINFO_TOTAL_TIME
+	};
+
+	// The scheduler. With limits set, handles are queued per host and
+	// priority level and only added to libcurl when there's room. Levels are
+	// served weighted round-robin, the hosts of a level plain round-robin.
+	typedef std::map<std::string, HostQueue*> Hosts;
+	typedef std::vector<HostQueue*> ReadyHosts;
+
+	unsigned max_in_flight_;      // 0 for no limit
+	unsigned max_host_in_flight_; // same
+	double host_rate_;            // transfers per second and host, 0 for no limit
+	double host_burst_;
+	unsigned weights_[PRIORITY_LEVELS];
+	unsigned credits_[PRIORITY_LEVELS];
+	ReadyHosts ready_[PRIORITY_LEVELS]; // hosts with queued handles per level
+	size_t cursors_[PRIORITY_LEVELS];
+	Hosts hosts_;
+	size_t sweep_at_;             // hosts_ size that triggers SweepHosts()
+	unsigned num_pending_;
+	unsigned num_active_;         // added to libcurl
+	ev_timer admit_timer_;        // for when the token buckets have run dry
+	bool admitting_;
+
+	Statistics stats_;
 	unsigned num_handles_;
-	SockFDs sockfds_;
+	Watchers sockfds_;
+	Watchers free_watchers_;
+	std::vector<ev_io*> watcher_blocks_;
+	bool processing_;      // inside curl_multi_socket_action()
+	bool timeout_pending_; // libcurl asked for an immediate timeout while processing_
 	CURLM* const mh_;
 	ev_timer timer_;
 
 	MultiHandle();
-	~MultiHandle();
-	bool ProcessEvents();
+	CURLMcode AddHandle(EasyHandle& ch);
+	bool ProcessEvents(curl_socket_t sockfd, int ev_bitmask);
+	ev_io* NewWatcher(curl_socket_t sockfd);
+	void DeleteWatcher(ev_io* w);
+	void DeliverCompletions(const Completions& done);
+	void CountTransfer(CURL* ch, CURLcode result);
+	bool Throttled();
+	void QueueHandle(EasyHandle& ch);
+	void UnqueueHandle(EasyHandle& ch);
+	bool Admit();
+	EasyHandle* NextHandle(double now, double* wait);
+	bool Admissible(HostQueue& h, double now, double* wait);
+	void ReleaseHost(EasyHandle& ch);
+	void DropHostIfIdle(HostQueue* h);
+	void SweepHosts();
+	void AdmitPending();
+	void CountHandle();
+	bool RunSocketAction(curl_socket_t sockfd, int ev_bitmask);
+	static void AdmitTimerFunction(ev_timer* w, int events);
 
 	static int TimerFunction(CURLM* mh, long timeout, void* userp);
 	static int SocketFunction(
@@ -90,6 +596,179 @@ private:
 	static MultiHandle* singleton_;
 };
 
+//
+// WorkerPool definition
+//
+// A bunch of threads that each drive their own CURLM. Easy handles are moved
+// over to a worker for the duration of the transfer, that only works for
+// transfers that don't call into JS while running, so body accumulation (or
+// no body at all) and no share handle.
+//
+class WorkerPool: public ObjectWrap {
+public:
+	static Handle<Object> New(unsigned num_threads);
+	static bool IsInstanceOf(Handle<Value> val);
+	static WorkerPool* Unwrap(Handle<Value> handle);
+	Handle<Value> Add(EasyHandle& ch);
+	Handle<Value> AddMany(const EasyHandles& handles);
+	virtual ~WorkerPool();
+
+private:
+	// lock-free multiple producer, single consumer stack; the consumer takes
+	// the whole list at once so there's no ABA problem
+	class JobQueue {
+	public:
+		JobQueue();
+		void Push(EasyHandle* ch);
+		EasyHandle* TakeAll(); // oldest first
+	private:
+		EasyHandle* volatile head_;
+	};
+
+	struct Worker {
+		WorkerPool* pool;
+		pthread_t thread;
+		CURLM* mh;
+		int wakefds[2];
+		JobQueue jobs;
+		volatile bool quit;
+	};
+
+	std::vector<Worker*> workers_;
+	unsigned next_worker_;
+	unsigned num_handles_;
+	JobQueue done_;
+	ev_async async_;
+
+	WorkerPool();
+	bool Start(unsigned num_threads);
+	void Stop();
+
+	static void* ThreadMain(void* arg);
+	static void Wake(Worker& w);
+	static void Wait(Worker& w);
+	static void AsyncEventFunction(ev_async* w, int events);
+};
+
+//
+// DnsCache definition
+//
+// Process-wide, host names are resolved on a few threads of their own and
+// refreshed before they expire so a transfer never waits for the resolver;
+// a resolver that hangs on one host holds up only one thread. Entries that
+// haven't been used for a few TTLs are dropped.
+//
+class DnsCache {
+public:
+	static void Prefetch(const std::string& host_port);
+	static bool Lookup(const std::string& host_port, std::string* addrs);
+	static void SetTTL(double ttl);
+
+private:
+	struct Entry {
+		std::string addrs; // comma separated, CURLOPT_RESOLVE style
+		double expires;    // 0 until resolved
+		double retry;      // after a failed refresh, when to try again
+		double last_used;
+		bool resolving;
+	};
+	typedef std::map<std::string, Entry> Entries;
+
+	static Entries entries_;
+	static double ttl_;
+	static unsigned num_threads_;
+	static pthread_mutex_t lock_;
+	static pthread_cond_t wakeup_;
+
+	static void Start();
+	static void Queue(const std::string& host_port, double now);
+	static void* ThreadMain(void* arg);
+	static bool Resolve(const std::string& host_port, std::string* addrs);
+	static double Now();
+
+	enum { MAX_THREADS = 4 };
+};
+
+//
+// Progress definition
+//
+// Calls a single JS function at a fixed interval with the progress of all
+// transfers that made any since the last call. Main thread only, the handles
+// record their progress themselves.
+//
+class Progress {
+public:
+	static void SetCallback(Handle<Value> callback, double interval);
+	static void Watch(EasyHandle* ch);
+	static void Unwatch(EasyHandle* ch);
+
+private:
+	static std::vector<EasyHandle*> handles_;
+	static Persistent<Function> callback_;
+	static ev_timer timer_;
+	static double interval_;
+
+	static void Update();
+	static void TimerFunction(ev_timer* w, int events);
+};
+
+//
+// Download definition
+//
+// One object fetched with several ranged transfers at once. A probe for the
+// first byte gets the size from Content-Range, then the file is allocated and
+// the rest is split into segments that write at their offset. A failed
+// segment is retried from where it stopped, on its own; when one fails for
+// good the others are aborted. A server that ignores the range sends the
+// whole body to the probe and that's it.
+//
+class Download {
+public:
+	static Handle<Value> Start(Handle<Value> url, int fd, unsigned segments,
+		Handle<Array> options, Handle<Value> callback, MultiHandle* mh);
+
+private:
+	struct Segment {
+		Download* download;
+		EasyHandle* ch;
+		Persistent<Object> handle;
+		curl_off_t start; // next byte to fetch
+		curl_off_t end;   // last byte, -1 for up to the end
+		unsigned retries;
+	};
+
+	int fd_;
+	unsigned num_segments_;
+	MultiHandle* mh_;
+	Persistent<Object> multi_; // keeps mh_ alive
+	Persistent<Value> url_;
+	Persistent<Array> options_; // [option, value, ...] for every segment
+	Persistent<Function> callback_;
+	Persistent<Value> error_;   // the first one, the download fails as a whole
+	std::vector<Segment*> segments_;
+	unsigned active_;           // segments in flight, plus one while setting up
+	bool probing_;
+	curl_off_t bytes_;
+	ev_timer finish_timer_;     // the callback always runs from the loop
+
+	Download(int fd, unsigned segments, MultiHandle* mh);
+	~Download();
+	Segment* NewSegment(curl_off_t start, curl_off_t end);
+	Handle<Value> Perform(Segment* s);
+	void Split(Segment* s);
+	void Complete(Segment* s, CURLcode result, curl_off_t size);
+	void Fail(Handle<Value> error);
+	void Release();
+	void Finish();
+
+	static void CompleteFunction(EasyHandle* ch, CURLcode result, curl_off_t size, void* data);
+	static void FinishTimerFunction(ev_timer* w, int events);
+
+	enum { MAX_RETRIES = 3, MAX_SEGMENTS = 64 };
+};
+
+Handle<Value> SetOption(EasyHandle* ch, CURLoption option, Handle<Value> value);
+
 //
 // EasyHandle implementation
 //
@@ -108,7 +787,8 @@ bool EasyHandle::IsInstanceOf(Handle<Value> val) {
 	if (val->IsObject()) {
 		Local<Object> o = val->ToObject();
 		return o->InternalFieldCount() >= 2
-			&& o->GetPointerFromInternalField(1) == reinterpret_cast<void*>(&easyHandleTemplate);
+			&& o->GetPointerFromInternalField(1) == reinterpret_cast<void*>(&easyHandleTemplate)
+			&& !ObjectWrap::Unwrap<EasyHandle>(o)->IsClosed();
 	}
 	else {
 		return false;
@@ -124,505 +804,4461 @@ EasyHandle* EasyHandle::Unwrap(Handle<Value> handle) {
 	}
 }
 
-EasyHandle::EasyHandle(): ch_(curl_easy_init()) {
+EasyHandle* EasyHandle::FromCURL(CURL* ch) {
+	EasyHandle* self = NULL;
+	curl_easy_getinfo(ch, CURLINFO_PRIVATE, reinterpret_cast<char**>(&self));
+	return self;
+}
+
+EasyHandle::Pool EasyHandle::pool_;
+size_t EasyHandle::pool_size_ = 16;
+
+// recycles libcurl handles of collected EasyHandles, that saves the allocations
+// curl_easy_init() does and keeps the handle's DNS cache and session IDs warm
+CURL* EasyHandle::AcquireCURL() {
+	if (pool_.empty()) {
+		return curl_easy_init();
+	}
+
+	CURL* ch = pool_.back();
+	pool_.pop_back();
+	return ch;
+}
+
+// `reset` is false when the handle has just been reset already
+void EasyHandle::ReleaseCURL(CURL* ch, bool reset) {
+	if (pool_.size() < pool_size_) {
+		if (reset) {
+			// curl_easy_reset() leaves the handle attached to its share handle
+			curl_easy_setopt(ch, CURLOPT_SHARE, static_cast<CURLSH*>(NULL));
+			curl_easy_reset(ch);
+		}
+		pool_.push_back(ch);
+	}
+	else {
+		curl_easy_cleanup(ch);
+	}
+}
+
+void EasyHandle::SetPoolSize(size_t size) {
+	pool_size_ = size;
+
+	while (pool_.size() > pool_size_) {
+		curl_easy_cleanup(pool_.back());
+		pool_.pop_back();
+	}
+}
+
+EasyHandle::EasyHandle():
+	ch_(AcquireCURL()), in_flight_(false), in_multi_(false), queued_(false), off_thread_(false), auto_close_(false), next_job_(NULL), result_(CURLE_OK),
+	priority_(PRIORITY_DEFAULT), use_dns_cache_(false), progress_(false), progress_watched_(false), progress_index_(0),
+	progress_dirty_(false), host_queue_(NULL),
+	upload_stream_(false), upload_offset_(0), upload_queued_(0), upload_ended_(false), upload_paused_(false),
+	pause_state_(CURLPAUSE_CONT), complete_hook_(NULL), complete_hook_data_(NULL),
+	write_offset_(0), write_highwatermark_(0), write_max_delay_ms_(0),
+	accumulate_(false), body_(NULL), body_size_(0), body_capacity_(0), capture_headers_(false),
+	file_fd_(-1), file_owned_(false), file_start_(0), file_pos_(0), file_buf_(NULL),
+	file_buf_used_(0), file_error_(false), file_finished_(false),
+	range_start_(-1), range_whole_(false), range_checked_(false),
+	dependents_(0)
+{
+	ev_init(&flush_timer_, FlushTimerFunction);
+	flush_timer_.data = reinterpret_cast<void*>(this);
+
 	if (ch_ == NULL) {
 		Error("curl_easy_init() returned NULL!");
 	}
+	else {
+		// lets the multi handle map finished transfers back to their EasyHandle
+		curl_easy_setopt(ch_, CURLOPT_PRIVATE, this);
+	}
 }
 
 EasyHandle::~EasyHandle() {
+	ev_timer_stop(&flush_timer_);
+	if (progress_watched_) {
+		Progress::Unwatch(this);
+	}
 	read_callback_.Dispose();
+	ClearUploads();
 	write_callback_.Dispose();
-	curl_easy_cleanup(ch_);
+	complete_callback_.Dispose();
+	write_buffer_.Dispose();
+	ClearBody();
+	CloseWriteFile();
+	free(file_buf_);
+	if (in_flight_) {
+		curl_easy_cleanup(ch_); // still attached to a multi handle, don't recycle
+	}
+	else if (ch_ != NULL) {
+		DetachStreamDepends();
+		ReleaseCURL(ch_);
+	}
+	FreeSLists();
+	share_.Dispose();
+	SetStreamDepends(Handle<Object>());
 }
 
 EasyHandle::operator CURL*() {
 	return ch_;
 }
 
-void EasyHandle::SetWriteCallback(Handle<Value> callback) {
-	Local<Function> fun = Local<Function>(Function::Cast(*callback));
-	write_callback_.Clear();
-	write_callback_ = Persistent<Function>::New(fun);
+// libcurl doesn't copy lists, the handle owns them until they're replaced
+void EasyHandle::SetSList(CURLoption option, curl_slist* slist) {
+	for (SLists::iterator it = slists_.begin(); it != slists_.end(); ++it) {
+		if (it->first == option) {
+			if (!arena_.Contains(it->second)) {
+				curl_slist_free_all(it->second);
+			}
+			it->second = slist;
+			return;
+		}
+	}
+
+	if (slist != NULL) {
+		slists_.push_back(SLists::value_type(option, slist));
+	}
 }
 
-Handle<Value> EasyHandle::InvokeWriteCallback(Buffer* data) {
-	HandleScope scope;
+void EasyHandle::FreeSLists() {
+	for (SLists::iterator it = slists_.begin(); it != slists_.end(); ++it) {
+		if (!arena_.Contains(it->second)) {
+			curl_slist_free_all(it->second);
+		}
+	}
+	slists_.clear();
+}
 
-	Local<Object> global = Context::GetCurrent()->Global();
-	Handle<Value> args[] = { data->handle_ };
-	Local<Value> rv = write_callback_->Call(global, 1, args);
+// valid until the next call, libcurl copies strings anyway so there's no
+// point in allocating them
+const char* EasyHandle::ToUtf8(Handle<Value> value, size_t* length) {
+	Local<String> s = value->ToString();
+	const int n = s->Utf8Length();
 
-	return scope.Close(rv);
+	utf8_.resize(n + 1);
+	s->WriteUtf8(&utf8_[0], n);
+	utf8_[n] = '\0';
+
+	if (length != NULL) {
+		*length = n;
+	}
+
+	return &utf8_[0];
 }
 
-//
-// MultiHandle implementation
-//
-MultiHandle* MultiHandle::singleton_;
+// libcurl only reads lists, the first one for `option` lives in the arena,
+// nodes and strings alike; the arena is only reclaimed by a reset, so lists
+// that replace another one are malloc'd and freed when they're replaced
+curl_slist* EasyHandle::NewSList(CURLoption option, Handle<Array> array) {
+	curl_slist* head = NULL;
+	curl_slist** tail = &head;
 
-MultiHandle::MultiHandle(): num_handles_(0), mh_(curl_multi_init()) {
-	if (mh_ == 0) {
-		Error("curl_multi_init() returned NULL!");
+	bool replaces = false;
+	for (SLists::iterator it = slists_.begin(); it != slists_.end() && !replaces; ++it) {
+		replaces = it->first == option;
 	}
-	else {
-		curl_multi_setopt(mh_, CURLMOPT_SOCKETFUNCTION, SocketFunction);
-		curl_multi_setopt(mh_, CURLMOPT_SOCKETDATA, this);
 
-		curl_multi_setopt(mh_, CURLMOPT_TIMERFUNCTION, TimerFunction);
-		curl_multi_setopt(mh_, CURLMOPT_TIMERDATA, this);
+	for (uint32_t i = 0; i < array->Length(); ++i) {
+		if (replaces) {
+			curl_slist* slist = curl_slist_append(head, ToUtf8(array->Get(i)));
+			if (slist == NULL) {
+				curl_slist_free_all(head);
+				return NULL;
+			}
+			head = slist;
+			continue;
+		}
 
-		ev_init(&timer_, TimerEventFunction);
+		Local<String> s = array->Get(i)->ToString();
+		const int n = s->Utf8Length();
+
+		curl_slist* node = static_cast<curl_slist*>(arena_.Alloc(sizeof(curl_slist) + n + 1));
+		if (node == NULL) {
+			return NULL;
+		}
+		node->data = reinterpret_cast<char*>(node + 1);
+		node->next = NULL;
+		s->WriteUtf8(node->data, n);
+		node->data[n] = '\0';
+
+		*tail = node;
+		tail = &node->next;
 	}
-}
 
-MultiHandle::~MultiHandle() {
-	// complain if there are still easy handles pending?
-	curl_multi_cleanup(mh_);
+	return head;
 }
 
-bool MultiHandle::Initialize() {
-	assert(singleton_ == NULL);
-	singleton_ = new MultiHandle();
-	return singleton_->mh_ != NULL;
+CURLcode EasyHandle::SetPostFields(const char* data, size_t size) {
+	post_fields_.assign(data, data + size);
+
+	CURLcode status = curl_easy_setopt(ch_, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(size));
+	if (status == CURLE_OK) {
+		const char* fields = post_fields_.empty() ? "" : &post_fields_[0];
+		status = curl_easy_setopt(ch_, CURLOPT_POSTFIELDS, fields);
+	}
+
+	return status;
 }
 
-MultiHandle& MultiHandle::Singleton() {
-	return *singleton_;
+// The handle is pinned from the moment it's handed to a multi handle or
+// worker pool, it's only unpinned by the caller of InvokeCompleteCallback()
+// once the callback has run; a handle that's performed again from its own
+// callback is pinned again first so it stays alive throughout.
+// main thread only; the handle is watched for progress once it's been accepted,
+// a perform that throws leaves nothing behind
+void EasyHandle::SetInFlight(bool in_flight) {
+	if (in_flight && !in_flight_) {
+		Pin();
+		if (progress_ && !progress_watched_) {
+			for (int i = 0; i < 4; ++i) {
+				progress_values_[i] = 0;
+			}
+			progress_dirty_ = false;
+			Progress::Watch(this);
+		}
+	}
+	in_flight_ = in_flight;
 }
 
-bool MultiHandle::ProcessEvents() {
-	int running_handles;
-	CURLMcode status;
+bool EasyHandle::IsInFlight() {
+	return in_flight_;
+}
 
-	running_handles = 0;
-	do {
-		status = curl_multi_socket_all(mh_, &running_handles);
-	}
-	while (status == CURLM_CALL_MULTI_PERFORM);
+// remembers the host and port part of `url`, lowercased; the port is made
+// explicit for http and https
+void EasyHandle::SetHost(const char* url) {
+	const char* p = strstr(url, "://");
+	const char* scheme = p ? url : NULL;
+	const size_t scheme_len = p ? p - url : 0;
+	p = p ? p + 3 : url;
 
-	if (status != CURLM_OK) {
-		CurlError(status); // safe to call, this code runs in the same thread as V8
-	}
+	const size_t len = strcspn(p, "/?#");
+	const char* at = static_cast<const char*>(memchr(p, '@', len));
+	const char* start = at ? at + 1 : p;
 
-	if (running_handles == 0) {
-		ev_timer_stop(&timer_);
-		ev_unref();
+	host_.assign(start, p + len);
+	for (std::string::iterator it = host_.begin(); it != host_.end(); ++it) {
+		*it = tolower(static_cast<unsigned char>(*it));
 	}
 
-	int msgs_in_queue;
-	CURLMsg *msg;
-
-	msgs_in_queue = 0;
-	while ((msg = curl_multi_info_read(mh_, &msgs_in_queue))) {
-		if (msg->msg == CURLMSG_DONE) {
-			curl_multi_remove_handle(mh_, msg->easy_handle);
+	const size_t bracket = host_.rfind(']');
+	const size_t colon = host_.rfind(':');
+	if (colon == std::string::npos || (bracket != std::string::npos && colon < bracket)) {
+		if (scheme == NULL || (scheme_len == 4 && strncasecmp(scheme, "http", 4) == 0)) {
+			host_.append(":80");
+		}
+		else if (scheme_len == 5 && strncasecmp(scheme, "https", 5) == 0) {
+			host_.append(":443");
 		}
 	}
-	assert(msgs_in_queue == 0);
-
-	return status == CURLM_OK;
 }
 
-void MultiHandle::TimerEventFunction(ev_timer* w, int events) {
-	MultiHandle& self = *reinterpret_cast<MultiHandle*>(w->data);
-
-	fprintf(stderr, "%s: events=%d\n", __func__, events);
-	self.ProcessEvents();
+void EasyHandle::SetPriority(int priority) {
+	priority_ = priority;
 }
 
-int MultiHandle::TimerFunction(CURLM* /*handle*/, long timeout, void* userp) {
-	MultiHandle& self = *reinterpret_cast<MultiHandle*>(userp);
+// hosts are resolved ahead of time by DnsCache, the result is handed to
+// libcurl with CURLOPT_RESOLVE when the transfer starts; a miss adds the host
+// to the cache and leaves the lookup to libcurl this time
+void EasyHandle::SetUseDnsCache(bool use) {
+	use_dns_cache_ = use;
 
-	if (timeout > 1000) timeout = 1000;
+	if (!use) {
+		RestoreResolve();
+	}
+}
 
-	fprintf(stderr, "%s: timeout=%ld\n", __func__, timeout);
+// back to the user's CURLOPT_RESOLVE list, if any
+void EasyHandle::RestoreResolve() {
+	curl_slist* slist = NULL;
+	for (SLists::const_iterator it = slists_.begin(); it != slists_.end(); ++it) {
+		if (it->first == CURLOPT_RESOLVE) {
+			slist = it->second;
+		}
+	}
+	curl_easy_setopt(ch_, CURLOPT_RESOLVE, slist);
+	SetSList(static_cast<CURLoption>(NODECURLOPT_DNS_CACHE), NULL);
+}
+
+// right before the handle is passed on to a multi handle or worker pool
+void EasyHandle::PrepareTransfer() {
+	if (in_flight_) {
+		return;
+	}
+
+	ApplyDnsCache();
+}
+
+// not while the transfer is in flight, libcurl may still look at the list
+void EasyHandle::ApplyDnsCache() {
+	if (!use_dns_cache_ || in_flight_ || host_.find(':') == std::string::npos || host_[0] == '[') {
+		return;
+	}
+
+#if LIBCURL_VERSION_NUM >= 0x074b00
+	// the user's entries are applied in order and the last one for a host
+	// wins, so a host the user pinned (or unpinned) is left alone
+	const curl_slist* user = NULL;
+	for (SLists::const_iterator it = slists_.begin(); it != slists_.end(); ++it) {
+		if (it->first == CURLOPT_RESOLVE) {
+			user = it->second;
+		}
+	}
+	for (const curl_slist* item = user; item != NULL; item = item->next) {
+		const char* entry = item->data + (item->data[0] == '+' || item->data[0] == '-');
+		if (strncmp(entry, host_.c_str(), host_.size()) == 0
+			&& (entry[host_.size()] == ':' || entry[host_.size()] == '\0'))
+		{
+			RestoreResolve();
+			return;
+		}
+	}
+
+	std::string addrs;
+	if (!DnsCache::Lookup(host_, &addrs)) {
+		RestoreResolve(); // not the addresses of a previous transfer
+		return;
+	}
+
+	// "+" entries time out like anything libcurl resolves itself, plain ones
+	// would stay in the multi handle's DNS cache for good and be used by every
+	// handle on it; a newer entry for the host replaces an older one
+	curl_slist* slist = NULL;
+	for (const curl_slist* item = user; item != NULL; item = item->next) {
+		slist = curl_slist_append(slist, item->data);
+	}
+	slist = curl_slist_append(slist, ("+" + host_ + ":" + addrs).c_str());
+
+	curl_easy_setopt(ch_, CURLOPT_RESOLVE, slist);
+	SetSList(static_cast<CURLoption>(NODECURLOPT_DNS_CACHE), slist);
+#else
+	// older versions only have permanent entries, the cache isn't used then
+#endif
+}
+
+// libcurl reports progress many times a second, it's only recorded here;
+// Progress reports all transfers at once every so often
+void EasyHandle::SetProgress(bool progress) {
+	progress_ = progress;
+
+	if (!progress && progress_watched_) {
+		Progress::Unwatch(this);
+	}
+}
+
+// no V8 in here, this runs on the worker threads too
+void EasyHandle::UpdateProgress(double dltotal, double dlnow, double ultotal, double ulnow) {
+	progress_values_[0] = dlnow;
+	progress_values_[1] = dltotal;
+	progress_values_[2] = ulnow;
+	progress_values_[3] = ultotal;
+	progress_dirty_ = true;
+}
+
+// keeps the handle from being collected while a transfer holds on to it
+void EasyHandle::Pin() {
+	Ref();
+}
+
+void EasyHandle::Unpin() {
+	Unref();
+}
+
+// true if the transfer can run without calling into JS
+bool EasyHandle::CanRunOffThread() {
+	return write_callback_.IsEmpty()
+		&& read_callback_.IsEmpty()
+		&& !upload_stream_
+		&& share_.IsEmpty()
+		&& stream_depends_.IsEmpty()
+		&& dependents_ == 0;
+}
+
+// restores the handle to its pristine state so it can be used for another
+// request, the libcurl handle and its caches are kept
+void EasyHandle::Reset() {
+	assert(!in_flight_);
+
+	ev_timer_stop(&flush_timer_);
+	pending_writes_.clear();
+	write_highwatermark_ = 0;
+	write_max_delay_ms_ = 0;
+
+	read_callback_.Dispose();
+	read_callback_.Clear();
+	upload_stream_ = false;
+	ClearUploads();
+	write_callback_.Dispose();
+	write_callback_.Clear();
+	complete_callback_.Dispose();
+	complete_callback_.Clear();
+	complete_hook_ = NULL;
+	complete_hook_data_ = NULL;
+
+	write_buffer_.Dispose();
+	write_buffer_.Clear();
+	write_offset_ = 0;
+
+	accumulate_ = false;
+	ClearBody();
+
+	capture_headers_ = false;
+	headers_.Clear();
+
+	host_.clear();
+	priority_ = PRIORITY_DEFAULT;
+	use_dns_cache_ = false;
+	progress_ = false;
+	if (progress_watched_) {
+		Progress::Unwatch(this);
+	}
+	auto_close_ = false;
+
+	CloseWriteFile();
+	file_path_.clear();
+	file_fd_ = -1;
+	file_start_ = 0;
+	file_pos_ = 0;
+	file_finished_ = false;
+	range_start_ = -1;
+	range_whole_ = false;
+	range_checked_ = false;
+
+	// curl_easy_reset() doesn't detach the share handle, do that before the
+	// reference that keeps it alive goes
+	curl_easy_setopt(ch_, CURLOPT_SHARE, static_cast<CURLSH*>(NULL));
+	DetachStreamDepends();
+	curl_easy_reset(ch_);
+	curl_easy_setopt(ch_, CURLOPT_PRIVATE, this);
+	FreeSLists();
+	arena_.Reset();
+	post_fields_.clear();
+
+	SetShare(Handle<Object>());
+	SetStreamDepends(Handle<Object>());
+}
+
+// Gives back everything the handle holds right away instead of when it's
+// collected, the libcurl handle goes back to the pool. A closed handle is no
+// longer a node-curl handle as far as the bindings are concerned.
+void EasyHandle::Close() {
+	assert(!in_flight_);
+
+	if (ch_ == NULL) {
+		return;
+	}
+
+	Reset();
+	FreeSLists();
+	arena_.FreeBlocks();
+	std::vector<char>().swap(post_fields_);
+	std::vector<char>().swap(utf8_);
+	std::vector<char>().swap(pending_writes_);
+	free(file_buf_);
+	file_buf_ = NULL;
+
+	ReleaseCURL(ch_, false); // Reset() did the curl_easy_reset()
+	ch_ = NULL;
+}
+
+bool EasyHandle::IsClosed() {
+	return ch_ == NULL;
+}
+
+// closes the handle when its completion callback returns, unless the
+// callback started another transfer on it
+void EasyHandle::SetAutoClose(bool auto_close) {
+	auto_close_ = auto_close;
+}
+
+// keeps the share handle alive for as long as this handle uses it
+void EasyHandle::SetShare(Handle<Object> share) {
+	share_.Dispose();
+	share_.Clear();
+
+	if (!share.IsEmpty()) {
+		share_ = Persistent<Object>::New(share);
+	}
+}
+
+// same for the handle this one's HTTP/2 stream depends on, the parent
+// counts its dependents so it isn't reset or closed under them
+void EasyHandle::SetStreamDepends(Handle<Object> parent) {
+	if (!stream_depends_.IsEmpty()) {
+		--ObjectWrap::Unwrap<EasyHandle>(stream_depends_)->dependents_;
+	}
+	stream_depends_.Dispose();
+	stream_depends_.Clear();
+
+	if (!parent.IsEmpty()) {
+		stream_depends_ = Persistent<Object>::New(parent);
+		++ObjectWrap::Unwrap<EasyHandle>(stream_depends_)->dependents_;
+	}
+}
+
+// curl_easy_reset() forgets the dependency without taking this handle off
+// the parent's list of dependents, libcurl does that when it's unset
+void EasyHandle::DetachStreamDepends() {
+#if LIBCURL_VERSION_NUM >= 0x072e00
+	if (!stream_depends_.IsEmpty()) {
+		curl_easy_setopt(ch_, CURLOPT_STREAM_DEPENDS, static_cast<CURL*>(NULL));
+	}
+#endif
+}
+
+bool EasyHandle::HasDependents() {
+	return dependents_ > 0;
+}
+
+// Request bodies are streamed from a queue of Buffers. Data gets queued with
+// curl_easy_upload() (push) or is asked for by calling read_callback_ with
+// the number of bytes libcurl wants when the queue runs dry (pull). The read
+// callback returns a Buffer, an empty Buffer for end of data or nothing when
+// it doesn't have data yet; the transfer is paused until data is pushed then.
+void EasyHandle::SetReadCallback(Handle<Value> callback) {
+	Local<Function> fun = Local<Function>(Function::Cast(*callback));
+	read_callback_.Dispose();
+	read_callback_ = Persistent<Function>::New(fun);
+	upload_stream_ = true;
+}
+
+void EasyHandle::SetUploadStream(bool upload_stream) {
+	upload_stream_ = upload_stream;
+	ClearUploads();
+}
+
+bool EasyHandle::IsUploadStream() {
+	return upload_stream_;
+}
+
+// `data` is a Buffer or null for end of data, returns the number of bytes queued
+size_t EasyHandle::QueueUpload(Handle<Value> data) {
+	if (data->IsNull()) {
+		upload_ended_ = true;
+	}
+	else {
+		Local<Object> buffer = data->ToObject();
+		if (Buffer::Length(buffer) > 0) {
+			uploads_.push_back(Persistent<Object>::New(buffer));
+			upload_queued_ += Buffer::Length(buffer);
+		}
+	}
+
+	if (upload_paused_) {
+		upload_paused_ = false;
+		Pause(pause_state_ & ~CURLPAUSE_SEND); // leave the download side alone
+	}
+
+	return upload_queued_;
+}
+
+size_t EasyHandle::Read(char* data, size_t size) {
+	if (uploads_.empty() && !upload_ended_ && !read_callback_.IsEmpty()) {
+		HandleScope scope;
+
+		Local<Object> global = Context::GetCurrent()->Global();
+		Handle<Value> args[] = { Integer::NewFromUnsigned(size) };
+		Local<Value> rv = read_callback_->Call(global, 1, args);
+
+		if (rv.IsEmpty()) {
+			return 0; // the callback threw, ReadFunction() aborts the transfer
+		}
+		if (Buffer::HasInstance(rv)) {
+			if (Buffer::Length(rv->ToObject()) == 0) {
+				upload_ended_ = true;
+			}
+			else {
+				QueueUpload(rv);
+			}
+		}
+	}
+
+	if (uploads_.empty()) {
+		if (upload_ended_) {
+			return 0;
+		}
+		upload_paused_ = true;
+		pause_state_ |= CURLPAUSE_SEND;
+		return CURL_READFUNC_PAUSE;
+	}
+
+	size_t nread = 0;
+
+	while (nread < size && !uploads_.empty()) {
+		Persistent<Object>& buffer = uploads_.front();
+		const size_t avail = Buffer::Length(buffer) - upload_offset_;
+		const size_t n = std::min(avail, size - nread);
+
+		memcpy(data + nread, Buffer::Data(buffer) + upload_offset_, n);
+		nread += n;
+		upload_offset_ += n;
+
+		if (upload_offset_ == Buffer::Length(buffer)) {
+			buffer.Dispose();
+			uploads_.pop_front();
+			upload_offset_ = 0;
+		}
+	}
+	upload_queued_ -= nread;
+
+	return nread;
+}
+
+void EasyHandle::ClearUploads() {
+	for (Uploads::iterator it = uploads_.begin(); it != uploads_.end(); ++it) {
+		it->Dispose();
+	}
+	uploads_.clear();
+	upload_offset_ = 0;
+	upload_queued_ = 0;
+	upload_ended_ = false;
+	upload_paused_ = false;
+	pause_state_ = CURLPAUSE_CONT;
+}
+
+void EasyHandle::SetWriteCallback(Handle<Value> callback) {
+	Local<Function> fun = Local<Function>(Function::Cast(*callback));
+	write_callback_.Clear();
+	write_callback_ = Persistent<Function>::New(fun);
+}
+
+void EasyHandle::SetWriteBuffer(Handle<Object> buffer) {
+	write_buffer_.Dispose();
+	write_buffer_ = Persistent<Object>::New(buffer);
+	write_offset_ = 0;
+}
+
+// a non-zero high-water mark makes Write() gather chunks natively and call
+// into JS once per batch, either when `highwatermark` bytes have piled up or
+// when the max delay has passed since the first chunk of the batch arrived
+void EasyHandle::SetWriteHighWaterMark(size_t highwatermark) {
+	FlushWrites();
+	write_highwatermark_ = highwatermark;
+}
+
+void EasyHandle::SetWriteMaxDelay(long max_delay_ms) {
+	FlushWrites();
+	write_max_delay_ms_ = max_delay_ms;
+}
+
+// collects the response body natively, it's handed to the completion callback
+// as a single Buffer and the write callback is never called
+void EasyHandle::SetAccumulate(bool accumulate) {
+	accumulate_ = accumulate;
+	ClearBody();
+}
+
+bool EasyHandle::AppendBody(const char* data, size_t size) {
+	if (body_size_ + size > body_capacity_) {
+		size_t capacity = body_capacity_;
+
+		if (capacity == 0) {
+			// the headers are in by now, size the buffer after Content-Length if there
+			// is one; that's the server's word, so only up to a point
+			double length = -1;
+			curl_easy_getinfo(ch_, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &length);
+			capacity = length > 0 ? static_cast<size_t>(std::min<double>(length, BODY_PRESIZE_MAX)) : CURL_MAX_WRITE_SIZE;
+		}
+		while (capacity < body_size_ + size) {
+			capacity *= 2;
+		}
+
+		char* body = reinterpret_cast<char*>(realloc(body_, capacity));
+		if (body == NULL) {
+			return false;
+		}
+		body_ = body;
+		body_capacity_ = capacity;
+	}
+
+	memcpy(body_ + body_size_, data, size);
+	body_size_ += size;
+
+	return true;
+}
+
+// transfers ownership of the body to a Buffer, no copy is made
+Handle<Value> EasyHandle::TakeBody() {
+	Buffer* buffer;
+
+	if (body_ == NULL) {
+		buffer = Buffer::New(0);
+	}
+	else {
+		buffer = Buffer::New(body_, body_size_, FreeBody, NULL);
+	}
+
+	body_ = NULL;
+	body_size_ = body_capacity_ = 0;
+
+	return buffer->handle_;
+}
+
+void EasyHandle::ClearBody() {
+	free(body_);
+	body_ = NULL;
+	body_size_ = body_capacity_ = 0;
+}
+
+void EasyHandle::FreeBody(char* data, void* /*hint*/) {
+	free(data);
+}
+
+// parsed response headers are handed to the completion callback
+void EasyHandle::SetCaptureHeaders(bool capture) {
+	capture_headers_ = capture;
+	headers_.Clear();
+}
+
+void EasyHandle::ParseHeader(const char* data, size_t size) {
+	headers_.Parse(data, size);
+}
+
+// Writes the body straight to a file, it never passes through JS. The file
+// is opened on the first write so a handle can be performed more than once.
+// No sendfile() or splice(), libcurl hands us the data in user space (and
+// decrypted or decoded) anyway; instead it's written out in big aligned
+// batches with pwrite(). No V8 in here, this runs on the worker threads too.
+bool EasyHandle::SetWriteFile(const char* path) {
+	CloseWriteFile();
+	file_path_ = path;
+	file_fd_ = -1;
+	file_pos_ = file_start_;
+	return true;
+}
+
+bool EasyHandle::SetWriteFile(int fd) {
+	CloseWriteFile();
+	file_path_.clear();
+	file_fd_ = fd;
+	file_pos_ = file_start_;
+	return fd >= 0;
+}
+
+void EasyHandle::SetWriteFileOffset(curl_off_t offset) {
+	file_start_ = file_pos_ = offset;
+}
+
+// in file mode, refuses the body (and fails the transfer with a write error)
+// unless it's a 206 whose Content-Range starts at `start`, or with `whole` any
+// other 2xx; -1 turns the check off. The headers must be captured.
+void EasyHandle::SetExpectedRange(curl_off_t start, bool whole) {
+	range_start_ = start;
+	range_whole_ = whole;
+	range_checked_ = false;
+}
+
+// no V8 in here, runs when the first bytes of the body come in
+bool EasyHandle::CheckRange() {
+	long status = 0;
+	curl_easy_getinfo(ch_, CURLINFO_RESPONSE_CODE, &status);
+
+	if (status != 206) {
+		return range_whole_ && status / 100 == 2;
+	}
+
+	size_t len;
+	const char* range = headers_.Find("content-range", &len); // "bytes start-end/size"
+	if (range == NULL || len <= 6 || memcmp(range, "bytes ", 6) != 0) {
+		return false;
+	}
+	const std::string value(range + 6, len - 6);
+	char* end;
+	const curl_off_t start = strtoll(value.c_str(), &end, 10);
+
+	return end != value.c_str() && *end == '-' && start == range_start_;
+}
+
+bool EasyHandle::WriteFile(const char* data, size_t size) {
+	if (file_error_) {
+		return false;
+	}
+
+	if (file_buf_ == NULL) {
+		void* buf;
+		if (posix_memalign(&buf, FILE_BUF_ALIGN, FILE_BUF_SIZE) != 0) {
+			return false;
+		}
+		file_buf_ = reinterpret_cast<char*>(buf);
+	}
+
+	file_finished_ = false;
+
+	while (size > 0) {
+		const size_t n = std::min(size, FILE_BUF_SIZE - file_buf_used_);
+		memcpy(file_buf_ + file_buf_used_, data, n);
+		file_buf_used_ += n;
+		data += n;
+		size -= n;
+
+		if (file_buf_used_ == FILE_BUF_SIZE && !FlushWriteFile()) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool EasyHandle::FlushWriteFile() {
+	if (file_fd_ < 0 && !file_path_.empty()) {
+		file_fd_ = open(file_path_.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (file_start_ == 0 ? O_TRUNC : 0), 0666);
+		file_owned_ = file_fd_ >= 0;
+	}
+	if (file_fd_ < 0) {
+		file_error_ = true;
+		return false;
+	}
+
+	size_t done = 0;
+	while (done < file_buf_used_) {
+		const ssize_t n = pwrite(file_fd_, file_buf_ + done, file_buf_used_ - done, file_pos_);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			file_error_ = true;
+			return false;
+		}
+		done += n;
+		file_pos_ += n;
+	}
+	file_buf_used_ = 0;
+
+	return true;
+}
+
+void EasyHandle::CloseWriteFile() {
+	if (file_owned_) {
+		close(file_fd_);
+		file_fd_ = -1;
+		file_owned_ = false;
+	}
+	file_buf_used_ = 0;
+	file_error_ = false;
+}
+
+// writes out what's left and closes the file if the handle opened it,
+// turns a write error into CURLE_WRITE_ERROR; safe to call more than once
+CURLcode EasyHandle::FinishWriteFile(CURLcode result) {
+	if (file_finished_ || (file_fd_ < 0 && file_path_.empty())) {
+		return result;
+	}
+	file_finished_ = true;
+
+	// a transfer that failed before any body came in leaves an existing file
+	// alone, otherwise this also creates the file when the body was empty
+	if (result != CURLE_OK && file_fd_ < 0 && file_buf_used_ == 0) {
+		return result;
+	}
+	if (!FlushWriteFile() && result == CURLE_OK) {
+		result = CURLE_WRITE_ERROR;
+	}
+
+	if (file_owned_) {
+		close(file_fd_);
+		file_fd_ = -1;
+		file_owned_ = false;
+	}
+
+	return result;
+}
+
+// CURLPAUSE_* bits, the transfer is paused in the direction(s) that are set
+CURLcode EasyHandle::Pause(int bitmask) {
+	pause_state_ = bitmask;
+	return curl_easy_pause(ch_, bitmask);
+}
+
+// running on a worker pool thread, the handle isn't ours to touch then
+bool EasyHandle::IsOffThread() {
+	return off_thread_;
+}
+
+bool IsPauseRequest(Handle<Value> rv) {
+	return !rv.IsEmpty() && rv->IsInt32() && rv->Int32Value() == CURL_WRITEFUNC_PAUSE;
+}
+
+// returns what the write function should return: `size` when the data has been
+// taken care of, 0 to abort the transfer or CURL_WRITEFUNC_PAUSE when the write
+// callback returned that, libcurl hands us the same data again after a resume
+size_t EasyHandle::Write(const char* data, size_t size) {
+	if (file_fd_ >= 0 || !file_path_.empty()) {
+		if (range_start_ >= 0 && !range_checked_) {
+			if (!CheckRange()) {
+				return 0;
+			}
+			range_checked_ = true;
+		}
+		return WriteFile(data, size) ? size : 0;
+	}
+
+	if (accumulate_) {
+		return AppendBody(data, size) ? size : 0;
+	}
+
+	if (write_callback_.IsEmpty()) {
+		return size; // discard
+	}
+
+	if (write_highwatermark_ == 0) {
+		HandleScope scope;
+		if (IsPauseRequest(InvokeWriteCallback(data, size))) {
+			pause_state_ |= CURLPAUSE_RECV;
+			return CURL_WRITEFUNC_PAUSE;
+		}
+		return size;
+	}
+
+	const bool first = pending_writes_.empty();
+	pending_writes_.insert(pending_writes_.end(), data, data + size);
+
+	if (pending_writes_.size() >= write_highwatermark_) {
+		FlushWrites();
+	}
+	else if (first && write_max_delay_ms_ > 0) {
+		ev_timer_set(&flush_timer_, write_max_delay_ms_ / 1000., 0.);
+		ev_timer_start(&flush_timer_);
+	}
+
+	return size;
+}
+
+void EasyHandle::FlushWrites() {
+	ev_timer_stop(&flush_timer_);
+
+	if (pending_writes_.empty()) {
+		return;
+	}
+
+	HandleScope scope;
+
+	Handle<Value> rv = InvokeWriteCallback(&pending_writes_[0], pending_writes_.size());
+	pending_writes_.clear();
+
+	// the batch has been delivered so there's nothing for libcurl to hand
+	// us again, pause the download explicitly instead
+	if (IsPauseRequest(rv)) {
+		Pause(pause_state_ | CURLPAUSE_RECV);
+	}
+}
+
+void EasyHandle::FlushTimerFunction(ev_timer* w, int /*events*/) {
+	EasyHandle& self = *reinterpret_cast<EasyHandle*>(w->data);
+
+	TryCatch tc;
+
+	self.FlushWrites();
+
+	if (tc.HasCaught()) {
+		FatalException(tc);
+	}
+}
+
+// calls write_callback_ with (buffer, start, end)
+//
+// if a write buffer has been set, the data is copied into it at a running
+// offset that wraps around when the chunk doesn't fit at the tail, that way
+// large downloads don't create a new Buffer for every chunk; the contents are
+// only valid until the buffer wraps around
+Handle<Value> EasyHandle::InvokeWriteCallback(const char* data, size_t size) {
+	if (write_callback_.IsEmpty()) {
+		return Undefined(); // discard
+	}
+
+	HandleScope scope;
+
+	Handle<Object> buffer;
+	size_t start = 0;
+
+	if (!write_buffer_.IsEmpty() && size <= Buffer::Length(write_buffer_)) {
+		if (write_offset_ + size > Buffer::Length(write_buffer_)) {
+			write_offset_ = 0;
+		}
+		start = write_offset_;
+		write_offset_ += size;
+
+		memcpy(Buffer::Data(write_buffer_) + start, data, size);
+		buffer = write_buffer_;
+	}
+	else {
+		// no write buffer or the chunk is too big for it
+		buffer = Buffer::New(const_cast<char*>(data), size)->handle_;
+	}
+
+	Local<Object> global = Context::GetCurrent()->Global();
+	Handle<Value> args[] = { buffer, Integer::New(start), Integer::New(start + size) };
+	Local<Value> rv = write_callback_->Call(global, 3, args);
+
+	return scope.Close(rv);
+}
+
+void EasyHandle::SetCompleteCallback(Handle<Value> callback) {
+	complete_callback_.Dispose();
+	complete_callback_.Clear();
+
+	if (callback->IsFunction()) {
+		Local<Function> fun = Local<Function>(Function::Cast(*callback));
+		complete_callback_ = Persistent<Function>::New(fun);
+	}
+}
+
+void EasyHandle::SetCompleteHook(CompleteHook hook, void* data) {
+	complete_hook_ = hook;
+	complete_hook_data_ = data;
+}
+
+// calls complete_callback_ with `this` set to the handle and a null or Error
+// argument, the error carries the CURLcode in its `code` property; the second
+// argument is the response body in accumulate mode, the number of bytes
+// written in file mode and undefined otherwise; the third argument is the
+// response headers when they're captured
+void EasyHandle::InvokeCompleteCallback(CURLcode result) {
+	if (progress_watched_) {
+		Progress::Unwatch(this);
+	}
+	FlushWrites();
+	ClearUploads(); // whatever is left belongs to this transfer
+
+	const bool file_mode = file_fd_ >= 0 || !file_path_.empty();
+	result = FinishWriteFile(result);
+	const curl_off_t file_size = file_pos_ - file_start_;
+	file_pos_ = file_start_;
+	file_error_ = false;
+	file_finished_ = false;
+	range_checked_ = false;
+
+	if (complete_hook_ != NULL) {
+		// the hook may start another transfer or close the handle, hands off
+		ClearBody();
+		complete_hook_(this, result, file_size, complete_hook_data_);
+		return;
+	}
+
+	if (complete_callback_.IsEmpty()) {
+		ClearBody();
+		headers_.Clear();
+		if (auto_close_ && !HasDependents()) {
+			Close();
+		}
+		return;
+	}
+
+	HandleScope scope;
+
+	// the callback may start a new transfer on this handle, don't let it clobber ours
+	Local<Function> callback = Local<Function>::New(complete_callback_);
+	complete_callback_.Dispose();
+	complete_callback_.Clear();
+
+	Handle<Value> body = Undefined();
+	if (file_mode) {
+		body = Number::New(file_size);
+	}
+	else if (accumulate_) {
+		body = TakeBody();
+	}
+
+	Handle<Value> ex = Null();
+	if (result != CURLE_OK) {
+		Local<Object> error = Exception::Error(String::New(curl_easy_strerror(result)))->ToObject();
+		error->Set(String::NewSymbol("code"), Integer::New(result));
+		ex = error;
+	}
+
+	Handle<Value> headers = Undefined();
+	if (capture_headers_) {
+		headers = Headers::New(headers_);
+	}
+
+	TryCatch tc;
+
+	Handle<Value> args[] = { ex, body, headers };
+	callback->Call(handle_, capture_headers_ ? 3 : 2, args);
+
+	if (tc.HasCaught()) {
+		FatalException(tc);
+	}
+
+	// a handle other streams depend on stays open until they let go of it
+	if (auto_close_ && !in_flight_ && !HasDependents()) {
+		Close();
+	}
+}
+
+// those of the last response, only when they're captured
+const HeaderArena& EasyHandle::GetHeaders() {
+	return headers_;
+}
+
+//
+// ShareHandle implementation
+//
+Handle<Object> ShareHandle::New() {
+	ShareHandle* const sh = new ShareHandle();
+
+	// glue C++ object to a V8-managed JS object
+	Local<Object> handle = shareHandleTemplate->NewInstance();
+	handle->SetPointerInInternalField(1, reinterpret_cast<void*>(&shareHandleTemplate)); // magic cookie
+	sh->Wrap(handle);
+
+	return sh->handle_;
+}
+
+bool ShareHandle::IsInstanceOf(Handle<Value> val) {
+	if (val->IsObject()) {
+		Local<Object> o = val->ToObject();
+		return o->InternalFieldCount() >= 2
+			&& o->GetPointerFromInternalField(1) == reinterpret_cast<void*>(&shareHandleTemplate);
+	}
+	else {
+		return false;
+	}
+}
+
+ShareHandle* ShareHandle::Unwrap(Handle<Value> handle) {
+	if (IsInstanceOf(handle)) {
+		return ObjectWrap::Unwrap<ShareHandle>(handle->ToObject());
+	}
+	else {
+		return NULL;
+	}
+}
+
+// no lock functions, the share handle is only ever used from the V8 thread
+ShareHandle::ShareHandle(): sh_(curl_share_init()) {
+	if (sh_ == NULL) {
+		Error("curl_share_init() returned NULL!");
+	}
+}
+
+// attached easy handles keep a reference to the share handle so by the time
+// this runs, none of them use it anymore
+ShareHandle::~ShareHandle() {
+	curl_share_cleanup(sh_);
+}
+
+ShareHandle::operator CURLSH*() {
+	return sh_;
+}
+
+//
+// Arena implementation
+//
+Arena::Arena(): head_(NULL), used_(0) {
+}
+
+Arena::~Arena() {
+	FreeBlocks();
+}
+
+void* Arena::Alloc(size_t size) {
+	size = (size + ALIGN - 1) & ~static_cast<size_t>(ALIGN - 1);
+
+	if (head_ == NULL || head_->size - used_ < size) {
+		const size_t block_size = std::max<size_t>(size, head_ ? 2 * head_->size : static_cast<size_t>(BLOCK_SIZE));
+		Block* block = static_cast<Block*>(malloc(sizeof(Block) + block_size));
+		if (block == NULL) {
+			return NULL;
+		}
+		block->prev = head_;
+		block->size = block_size;
+		head_ = block;
+		used_ = 0;
+	}
+
+	void* p = head_->Data() + used_;
+	used_ += size;
+
+	return p;
+}
+
+bool Arena::Contains(const void* p) const {
+	const char* c = static_cast<const char*>(p);
+	for (Block* b = head_; b != NULL; b = b->prev) {
+		if (c >= b->Data() && c < b->Data() + b->size) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void Arena::Reset() {
+	if (head_ != NULL && head_->prev != NULL) {
+		size_t total = 0;
+		for (Block* b = head_; b != NULL; b = b->prev) {
+			total += b->size;
+		}
+		FreeBlocks();
+
+		head_ = static_cast<Block*>(malloc(sizeof(Block) + total));
+		if (head_ != NULL) {
+			head_->prev = NULL;
+			head_->size = total;
+		}
+	}
+	used_ = 0;
+}
+
+void Arena::FreeBlocks() {
+	while (head_ != NULL) {
+		Block* prev = head_->prev;
+		free(head_);
+		head_ = prev;
+	}
+}
+
+//
+// Headers implementation
+//
+HeaderArena::HeaderArena(): status(0) {
+}
+
+// `line` is a single header line including the CRLF, folded lines are
+// appended to the previous header's value
+void HeaderArena::Parse(const char* line, size_t size) {
+	while (size > 0 && (line[size - 1] == '\r' || line[size - 1] == '\n')) {
+		--size;
+	}
+
+	if (size >= 5 && memcmp(line, "HTTP/", 5) == 0) {
+		// status line, a new response starts
+		Clear();
+		const char* sp = static_cast<const char*>(memchr(line, ' ', size));
+		if (sp != NULL) {
+			status = atoi(sp + 1);
+		}
+		return;
+	}
+
+	if (size == 0) {
+		return;
+	}
+
+	if (line[0] == ' ' || line[0] == '\t') {
+		if (!entries.empty()) {
+			size_t start = 0;
+			while (start < size && (line[start] == ' ' || line[start] == '\t')) {
+				++start;
+			}
+			buf.push_back(' ');
+			buf.append(line + start, size - start);
+			entries.back().value_len += 1 + size - start;
+		}
+		return;
+	}
+
+	const char* colon = static_cast<const char*>(memchr(line, ':', size));
+	if (colon == NULL) {
+		return;
+	}
+
+	Entry e;
+	e.name = buf.size();
+	e.name_len = colon - line;
+	for (const char* c = line; c < colon; ++c) {
+		buf.push_back(tolower(static_cast<unsigned char>(*c)));
+	}
+
+	const char* value = colon + 1;
+	const char* end = line + size;
+	while (value < end && (*value == ' ' || *value == '\t')) {
+		++value;
+	}
+	while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+		--end;
+	}
+
+	e.value = buf.size();
+	e.value_len = end - value;
+	buf.append(value, end - value);
+
+	entries.push_back(e);
+}
+
+// the value of the first `name` header (lowercase) or NULL
+const char* HeaderArena::Find(const char* name, size_t* len) const {
+	const size_t name_len = strlen(name);
+
+	for (size_t i = 0; i < entries.size(); ++i) {
+		const Entry& e = entries[i];
+		if (e.name_len == name_len && buf.compare(e.name, e.name_len, name) == 0) {
+			*len = e.value_len;
+			return buf.data() + e.value;
+		}
+	}
+
+	return NULL;
+}
+
+void HeaderArena::Clear() {
+	buf.clear();
+	entries.clear();
+	status = 0;
+}
+
+void HeaderArena::Swap(HeaderArena& other) {
+	buf.swap(other.buf);
+	entries.swap(other.entries);
+	std::swap(status, other.status);
+}
+
+// takes the contents of `arena`, it's left empty
+Handle<Object> Headers::New(HeaderArena& arena) {
+	Headers* const h = new Headers();
+	h->arena_.Swap(arena);
+
+	Local<Object> handle = headersTemplate->NewInstance();
+	h->Wrap(handle);
+
+	return h->handle_;
+}
+
+Handle<Value> Headers::Getter(Local<String> property, const AccessorInfo& info) {
+	Headers* h = ObjectWrap::Unwrap<Headers>(info.Holder());
+	String::Utf8Value name(property);
+
+	return h->Get(*name, name.length());
+}
+
+Handle<Integer> Headers::Query(Local<String> property, const AccessorInfo& info) {
+	Headers* h = ObjectWrap::Unwrap<Headers>(info.Holder());
+	String::Utf8Value name(property);
+
+	if (h->Get(*name, name.length()).IsEmpty()) {
+		return Handle<Integer>();
+	}
+
+	return Integer::New(ReadOnly);
+}
+
+// the names without duplicates
+Handle<Array> Headers::Enumerator(const AccessorInfo& info) {
+	Headers* h = ObjectWrap::Unwrap<Headers>(info.Holder());
+	const HeaderArena& a = h->arena_;
+
+	Local<Array> names = Array::New();
+	unsigned n = 0;
+
+	for (size_t i = 0; i < a.entries.size(); ++i) {
+		const HeaderArena::Entry& e = a.entries[i];
+		bool seen = false;
+		for (size_t j = 0; j < i && !seen; ++j) {
+			const HeaderArena::Entry& f = a.entries[j];
+			seen = f.name_len == e.name_len
+				&& a.buf.compare(f.name, f.name_len, a.buf, e.name, e.name_len) == 0;
+		}
+		if (!seen) {
+			names->Set(n++, String::New(a.buf.data() + e.name, e.name_len));
+		}
+	}
+
+	return names;
+}
+
+// repeated headers are joined with a comma, except Set-Cookie which is an
+// array; an empty handle for headers that aren't there
+Handle<Value> Headers::Get(const char* name, size_t len) {
+	const HeaderArena& a = arena_;
+
+	if (len == 7 && memcmp(name, ":status", 7) == 0) {
+		return Integer::New(a.status);
+	}
+
+	std::string lname(name, len);
+	for (size_t i = 0; i < len; ++i) {
+		lname[i] = tolower(static_cast<unsigned char>(lname[i]));
+	}
+	const bool is_cookie = lname == "set-cookie";
+
+	Local<Array> values;
+	std::string joined;
+	unsigned n = 0;
+
+	for (size_t i = 0; i < a.entries.size(); ++i) {
+		const HeaderArena::Entry& e = a.entries[i];
+		if (e.name_len != len || a.buf.compare(e.name, e.name_len, lname) != 0) {
+			continue;
+		}
+		if (is_cookie) {
+			if (n == 0) {
+				values = Array::New();
+			}
+			values->Set(n, String::New(a.buf.data() + e.value, e.value_len));
+		}
+		else {
+			if (n > 0) {
+				joined.append(", ");
+			}
+			joined.append(a.buf, e.value, e.value_len);
+		}
+		++n;
+	}
+
+	if (n == 0) {
+		return Handle<Value>();
+	}
+	else if (is_cookie) {
+		return values;
+	}
+	else {
+		return String::New(joined.data(), joined.size());
+	}
+}
+
+//
+// MultiHandle implementation
+//
+MultiHandle* MultiHandle::singleton_;
+
+Handle<Object> MultiHandle::New() {
+	MultiHandle* const mh = new MultiHandle();
+
+	// glue C++ object to a V8-managed JS object
+	Local<Object> handle = multiHandleTemplate->NewInstance();
+	handle->SetPointerInInternalField(1, reinterpret_cast<void*>(&multiHandleTemplate)); // magic cookie
+	mh->Wrap(handle);
+
+	return mh->handle_;
+}
+
+bool MultiHandle::IsInstanceOf(Handle<Value> val) {
+	if (val->IsObject()) {
+		Local<Object> o = val->ToObject();
+		return o->InternalFieldCount() >= 2
+			&& o->GetPointerFromInternalField(1) == reinterpret_cast<void*>(&multiHandleTemplate);
+	}
+	else {
+		return false;
+	}
+}
+
+MultiHandle* MultiHandle::Unwrap(Handle<Value> handle) {
+	if (IsInstanceOf(handle)) {
+		return ObjectWrap::Unwrap<MultiHandle>(handle->ToObject());
+	}
+	else {
+		return NULL;
+	}
+}
+
+MultiHandle::MultiHandle():
+	max_in_flight_(0), max_host_in_flight_(0), host_rate_(0), host_burst_(1), sweep_at_(SWEEP_MIN), num_pending_(0),
+	num_active_(0), admitting_(false), num_handles_(0), processing_(false), timeout_pending_(false),
+	mh_(curl_multi_init())
+{
+	for (int i = 0; i < PRIORITY_LEVELS; ++i) {
+		weights_[i] = credits_[i] = 1 << (PRIORITY_LEVELS - 1 - i); // 8:4:2:1
+		cursors_[i] = 0;
+	}
+	ev_init(&admit_timer_, AdmitTimerFunction);
+	admit_timer_.data = reinterpret_cast<void*>(this);
+
+	if (mh_ == 0) {
+		Error("curl_multi_init() returned NULL!");
+	}
+	else {
+		curl_multi_setopt(mh_, CURLMOPT_SOCKETFUNCTION, SocketFunction);
+		curl_multi_setopt(mh_, CURLMOPT_SOCKETDATA, this);
+
+		curl_multi_setopt(mh_, CURLMOPT_TIMERFUNCTION, TimerFunction);
+		curl_multi_setopt(mh_, CURLMOPT_TIMERDATA, this);
+
+		ev_init(&timer_, TimerEventFunction);
+		timer_.data = reinterpret_cast<void*>(this);
+	}
+}
+
+// the multi handle is pinned while it has transfers in flight so by the
+// time this runs, there are no easy handles or sockets left
+MultiHandle::~MultiHandle() {
+	assert(num_handles_ == 0);
+	ev_timer_stop(&timer_);
+	ev_timer_stop(&admit_timer_);
+
+	// only rate limit state is left by now
+	for (Hosts::iterator it = hosts_.begin(); it != hosts_.end(); ++it) {
+		delete it->second;
+	}
+
+	curl_multi_cleanup(mh_);
+
+	for (Watchers::iterator it = sockfds_.begin(); it != sockfds_.end(); ++it) {
+		if (*it != NULL) {
+			ev_io_stop(*it);
+		}
+	}
+	for (std::vector<ev_io*>::iterator it = watcher_blocks_.begin(); it != watcher_blocks_.end(); ++it) {
+		delete[] *it;
+	}
+}
+
+bool MultiHandle::Initialize() {
+	assert(singleton_ == NULL);
+	HandleScope scope;
+	singleton_ = Unwrap(New());
+	singleton_->Ref(); // never collected
+	return singleton_->mh_ != NULL;
+}
+
+MultiHandle& MultiHandle::Singleton() {
+	return *singleton_;
+}
+
+MultiHandle::operator CURLM*() {
+	return mh_;
+}
+
+// only lets libcurl look at the transfers that are bound to `sockfd`,
+// pass CURL_SOCKET_TIMEOUT to service expired timeouts
+bool MultiHandle::ProcessEvents(curl_socket_t sockfd, int ev_bitmask) {
+	bool ok = RunSocketAction(sockfd, ev_bitmask);
+
+	// finished transfers made room, start queued ones right away
+	while (ok && num_pending_ > 0 && !admitting_ && Admit()) {
+		ok = RunSocketAction(CURL_SOCKET_TIMEOUT, 0);
+	}
+
+	return ok;
+}
+
+bool MultiHandle::RunSocketAction(curl_socket_t sockfd, int ev_bitmask) {
+	int running_handles;
+	CURLMcode status;
+
+	const uint64_t start = MonotonicNanos();
+	++stats_.wakeups;
+	if (sockfd == CURL_SOCKET_TIMEOUT) {
+		++stats_.timer_events;
+	}
+	else {
+		++stats_.socket_events;
+	}
+
+	running_handles = 0;
+	processing_ = true;
+	for (;;) {
+		if (sockfd == CURL_SOCKET_TIMEOUT) {
+			timeout_pending_ = false;
+		}
+
+		do {
+			status = curl_multi_socket_action(mh_, sockfd, ev_bitmask, &running_handles);
+		}
+		while (status == CURLM_CALL_MULTI_PERFORM);
+
+		if (status != CURLM_OK || !timeout_pending_) {
+			break;
+		}
+
+		// a zero timeout, act on it now rather than on the next loop iteration
+		sockfd = CURL_SOCKET_TIMEOUT;
+		ev_bitmask = 0;
+	}
+	processing_ = false;
+	stats_.running_handles = running_handles;
+
+	if (status != CURLM_OK) {
+		CurlError(status); // safe to call, this code runs in the same thread as V8
+	}
+
+	if (running_handles == 0) {
+		ev_timer_stop(&timer_);
+	}
+
+	int msgs_in_queue;
+	CURLMsg *msg;
+	Completions done;
+
+	// drain the whole queue first, then call into JS once for the batch
+	msgs_in_queue = 0;
+	while ((msg = curl_multi_info_read(mh_, &msgs_in_queue))) {
+		if (msg->msg == CURLMSG_DONE) {
+			Completion c = { EasyHandle::FromCURL(msg->easy_handle), msg->data.result };
+			CountTransfer(msg->easy_handle, msg->data.result);
+			curl_multi_remove_handle(mh_, msg->easy_handle);
+			c.ch->in_multi_ = false;
+			ReleaseHost(*c.ch);
+			--num_active_;
+			done.push_back(c);
+		}
+	}
+	assert(msgs_in_queue == 0);
+
+	stats_.completions.Add(done.size());
+	stats_.process_time_ns.Add(MonotonicNanos() - start); // not counting the callbacks
+
+	if (!done.empty()) {
+		DeliverCompletions(done);
+	}
+
+	return status == CURLM_OK;
+}
+
+void MultiHandle::CountTransfer(CURL* ch, CURLcode result) {
+	long num_connects = 0, header_size = 0, request_size = 0;
+	double size_download = 0, size_upload = 0, total_time = 0;
+
+	curl_easy_getinfo(ch, CURLINFO_NUM_CONNECTS, &num_connects);
+	curl_easy_getinfo(ch, CURLINFO_HEADER_SIZE, &header_size);
+	curl_easy_getinfo(ch, CURLINFO_REQUEST_SIZE, &request_size);
+	curl_easy_getinfo(ch, CURLINFO_SIZE_DOWNLOAD, &size_download);
+	curl_easy_getinfo(ch, CURLINFO_SIZE_UPLOAD, &size_upload);
+	curl_easy_getinfo(ch, CURLINFO_TOTAL_TIME, &total_time);
+
+	++stats_.transfers;
+	if (result != CURLE_OK) {
+		++stats_.failed_transfers;
+	}
+	if (num_connects > 0) {
+		++stats_.connections;
+	}
+	stats_.bytes_in += header_size + static_cast<uint64_t>(size_download);
+	stats_.bytes_out += request_size + static_cast<uint64_t>(size_upload);
+	stats_.transfer_time_us.Add(static_cast<uint64_t>(total_time * 1e6));
+}
+
+MultiHandle::Statistics::Statistics():
+	running_handles(0), sockets(0), max_sockets(0), wakeups(0), socket_events(0),
+	timer_events(0), transfers(0), failed_transfers(0), connections(0), bytes_in(0),
+	bytes_out(0)
+{
+}
+
+// a snapshot of the counters, `clear` starts a new interval; the gauges
+// (handles, running, sockets) are not cleared
+Handle<Object> MultiHandle::Stats(bool clear) {
+	HandleScope scope;
+	Statistics& s = stats_;
+
+	Local<Object> o = Object::New();
+	o->Set(String::NewSymbol("handles"), Integer::NewFromUnsigned(num_handles_));
+	o->Set(String::NewSymbol("pending"), Integer::NewFromUnsigned(num_pending_));
+	o->Set(String::NewSymbol("running"), Integer::New(s.running_handles));
+	o->Set(String::NewSymbol("sockets"), Integer::NewFromUnsigned(s.sockets));
+	o->Set(String::NewSymbol("maxSockets"), Integer::NewFromUnsigned(s.max_sockets));
+	o->Set(String::NewSymbol("wakeups"), Number::New(s.wakeups));
+	o->Set(String::NewSymbol("socketEvents"), Number::New(s.socket_events));
+	o->Set(String::NewSymbol("timerEvents"), Number::New(s.timer_events));
+	o->Set(String::NewSymbol("transfers"), Number::New(s.transfers));
+	o->Set(String::NewSymbol("failedTransfers"), Number::New(s.failed_transfers));
+	o->Set(String::NewSymbol("connections"), Number::New(s.connections));
+	o->Set(String::NewSymbol("reuseRatio"),
+		Number::New(s.transfers ? 1. - static_cast<double>(s.connections) / s.transfers : 0.));
+	o->Set(String::NewSymbol("bytesIn"), Number::New(s.bytes_in));
+	o->Set(String::NewSymbol("bytesOut"), Number::New(s.bytes_out));
+	o->Set(String::NewSymbol("completionsPerWakeup"), s.completions.ToObject());
+	o->Set(String::NewSymbol("processTimeNs"), s.process_time_ns.ToObject());
+	o->Set(String::NewSymbol("transferTimeUs"), s.transfer_time_us.ToObject());
+
+	if (clear) {
+		Statistics fresh;
+		fresh.running_handles = s.running_handles;
+		fresh.sockets = fresh.max_sockets = s.sockets;
+		s = fresh;
+	}
+
+	return scope.Close(o);
+}
+
+// a handle is in flight until its own callback runs, so that the callback of
+// another handle in the batch can't start it again before its result is in
+void MultiHandle::DeliverCompletions(const Completions& done) {
+	HandleScope scope;
+
+	for (Completions::const_iterator it = done.begin(); it != done.end(); ++it) {
+		it->ch->SetInFlight(false);
+		it->ch->InvokeCompleteCallback(it->result);
+		it->ch->Unpin();
+	}
+
+	// account for the finished handles only now, callbacks may have queued
+	// new transfers and those should not take another reference on the loop
+	assert(num_handles_ >= done.size());
+	num_handles_ -= done.size();
+
+	if (num_handles_ == 0) {
+		ev_unref();
+		Unref();
+	}
+}
+
+void MultiHandle::TimerEventFunction(ev_timer* w, int events) {
+	MultiHandle& self = *reinterpret_cast<MultiHandle*>(w->data);
+
+	TRACE("%s: events=%d", __func__, events);
+	self.ProcessEvents(CURL_SOCKET_TIMEOUT, 0);
+}
+
+int MultiHandle::TimerFunction(CURLM* /*handle*/, long timeout, void* userp) {
+	MultiHandle& self = *reinterpret_cast<MultiHandle*>(userp);
+
+	TRACE("%s: timeout=%ld", __func__, timeout);
 	ev_timer_stop(&self.timer_);
-	ev_timer_set(&self.timer_, timeout / 1000., timeout / 1000.);
-	ev_timer_start(&self.timer_);
-	self.timer_.data = reinterpret_cast<void*>(&self);
 
-	return CURLM_OK;
+	if (timeout < 0) {
+		// no timeout, libcurl wants the timer deleted
+	}
+	else if (timeout == 0 && self.processing_) {
+		// can't call back into libcurl from here, ProcessEvents() picks it up
+		self.timeout_pending_ = true;
+	}
+	else {
+		// one-shot, libcurl tells us when it wants the next one
+		ev_timer_set(&self.timer_, timeout / 1000., 0.);
+		ev_timer_start(&self.timer_);
+	}
+
+	return CURLM_OK;
+}
+
+int curl2ev(int events) {
+	if (events == CURL_POLL_IN) {
+		return EV_READ;
+	}
+	if (events == CURL_POLL_OUT) {
+		return EV_WRITE;
+	}
+	if (events == CURL_POLL_INOUT) {
+		return EV_READ | EV_WRITE;
+	}
+	return 0;
+}
+
+int ev2curl(int events) {
+	int ev_bitmask = 0;
+	if (events & EV_READ) {
+		ev_bitmask |= CURL_CSELECT_IN;
+	}
+	if (events & EV_WRITE) {
+		ev_bitmask |= CURL_CSELECT_OUT;
+	}
+	return ev_bitmask;
+}
+
+ev_io* MultiHandle::NewWatcher(curl_socket_t sockfd) {
+	if (free_watchers_.empty()) {
+		ev_io* block = new ev_io[WATCHER_BLOCK_SIZE];
+		watcher_blocks_.push_back(block);
+		for (int i = WATCHER_BLOCK_SIZE - 1; i >= 0; --i) {
+			free_watchers_.push_back(&block[i]);
+		}
+	}
+
+	ev_io* w = free_watchers_.back();
+	free_watchers_.pop_back();
+
+	if (static_cast<size_t>(sockfd) >= sockfds_.size()) {
+		sockfds_.resize(sockfd + 1);
+	}
+	sockfds_[sockfd] = w;
+
+	if (++stats_.sockets > stats_.max_sockets) {
+		stats_.max_sockets = stats_.sockets;
+	}
+
+	return w;
+}
+
+void MultiHandle::DeleteWatcher(ev_io* w) {
+	sockfds_[w->fd] = NULL;
+	free_watchers_.push_back(w);
+	--stats_.sockets;
+}
+
+// libcurl hands back the watcher it was assigned with curl_multi_assign()
+// in `socketp`, no lookup is needed
+int MultiHandle::SocketFunction(
+	CURLM* /*handle*/, curl_socket_t sockfd, int events, void* userp, void* socketp)
+{
+	MultiHandle& self = *reinterpret_cast<MultiHandle*>(userp);
+
+	TRACE("%s: sockfd=%d, events=%d", __func__, sockfd, events);
+
+	// translate curl flags to libev flags
+	events = curl2ev(events);
+
+	ev_io* w = reinterpret_cast<ev_io*>(socketp);
+	if (w == NULL) {
+		if (events) {
+			// create I/O watcher and add it to the table
+			w = self.NewWatcher(sockfd);
+			ev_io_init(w, IOEventFunction, sockfd, events);
+			ev_io_start(w);
+			w->data = reinterpret_cast<void*>(&self);
+			curl_multi_assign(self.mh_, sockfd, w);
+		}
+		else {
+			assert(0 && "CURL_POLL_NONE or CURL_POLL_REMOVE for bad socket");
+		}
+	}
+	else {
+		if (events) {
+			// update the event flags, libev wants the watcher stopped for that
+			if ((w->events & (EV_READ | EV_WRITE)) != events) {
+				ev_io_stop(w);
+				ev_io_set(w, sockfd, events);
+				ev_io_start(w);
+			}
+		}
+		else {
+			// disarm and recycle fd watcher
+			ev_io_stop(w);
+			curl_multi_assign(self.mh_, sockfd, NULL);
+			self.DeleteWatcher(w);
+		}
+	}
+
+	return CURLM_OK;
+}
+
+void MultiHandle::IOEventFunction(ev_io* w, int events) {
+	MultiHandle& self = *reinterpret_cast<MultiHandle*>(w->data);
+
+	TRACE("%s: sockfd=%d, events=%d", __func__, w->fd, events);
+	self.ProcessEvents(w->fd, ev2curl(events));
+}
+
+// adds the handle without kicking off the transfer
+CURLMcode MultiHandle::AddHandle(EasyHandle& ch) {
+	// libcurl arms a zero timeout for the new handle, no need to go through
+	// the event loop for that, the caller's ProcessEvents() takes care of it
+	processing_ = true;
+	CURLMcode status = curl_multi_add_handle(mh_, ch);
+	processing_ = false;
+
+	if (status != CURLM_OK) {
+		return status;
+	}
+
+	ch.SetInFlight(true);
+	ch.in_multi_ = true;
+	++num_active_;
+
+	return CURLM_OK;
+}
+
+// queued handles count as well, they keep the loop alive
+void MultiHandle::CountHandle() {
+	if (++num_handles_ == 1) {
+		ev_ref();
+		Ref();
+	}
+}
+
+Handle<Value> MultiHandle::Add(EasyHandle& ch) {
+	if (ch.IsInFlight()) {
+		return Error("The handle is already in use.");
+	}
+
+	if (Throttled()) {
+		QueueHandle(ch);
+	}
+	else {
+		CURLMcode status = AddHandle(ch);
+		if (status != CURLM_OK) {
+			return CurlError(status);
+		}
+		CountHandle();
+	}
+
+	// kick off the transfer
+	ProcessEvents(CURL_SOCKET_TIMEOUT, 0);
+
+	return Undefined();
+}
+
+// adds all handles and then kicks off the transfers with a single sweep
+// all or nothing, like WorkerPool::AddMany()
+Handle<Value> MultiHandle::AddMany(const EasyHandles& handles) {
+	for (EasyHandles::const_iterator it = handles.begin(); it != handles.end(); ++it) {
+		if ((*it)->IsInFlight()) {
+			return Error("The handle is already in use.");
+		}
+	}
+	if (HasDuplicates(handles)) {
+		return Error("The same handle can't be added twice.");
+	}
+
+	// either all of them are queued or none, queueing can't fail
+	if (Throttled()) {
+		for (EasyHandles::const_iterator it = handles.begin(); it != handles.end(); ++it) {
+			QueueHandle(**it);
+		}
+		ProcessEvents(CURL_SOCKET_TIMEOUT, 0);
+		return Undefined();
+	}
+
+	CURLMcode status = CURLM_OK;
+	EasyHandles::const_iterator it;
+
+	for (it = handles.begin(); it != handles.end(); ++it) {
+		status = AddHandle(**it);
+		if (status != CURLM_OK) {
+			break;
+		}
+	}
+
+	if (status != CURLM_OK) {
+		// take back the ones that made it
+		while (it != handles.begin()) {
+			EasyHandle& ch = **--it;
+			curl_multi_remove_handle(mh_, ch);
+			ch.in_multi_ = false;
+			--num_active_;
+			ch.SetInFlight(false);
+			if (ch.progress_watched_) {
+				Progress::Unwatch(&ch);
+			}
+			ch.Unpin();
+		}
+		return CurlError(status);
+	}
+
+	for (it = handles.begin(); it != handles.end(); ++it) {
+		CountHandle();
+	}
+
+	ProcessEvents(CURL_SOCKET_TIMEOUT, 0);
+
+	return Undefined();
+}
+
+HostQueue::HostQueue(const std::string& name):
+	name(name), in_flight(0), num_pending(0), tokens(0), refilled(0)
+{
+}
+
+void HostQueue::Refill(double now, double rate, double burst) {
+	tokens = std::min(burst, tokens + (now - refilled) * rate);
+	refilled = now;
+}
+
+bool MultiHandle::Throttled() {
+	// once something is queued everything is, or FIFO order breaks
+	return max_in_flight_ > 0 || max_host_in_flight_ > 0 || host_rate_ > 0 || num_pending_ > 0;
+}
+
+void MultiHandle::QueueHandle(EasyHandle& ch) {
+	if (hosts_.size() >= sweep_at_) {
+		SweepHosts();
+	}
+
+	HostQueue*& h = hosts_[ch.host_];
+	if (h == NULL) {
+		h = new HostQueue(ch.host_);
+		h->tokens = host_burst_;
+		h->refilled = ev_now();
+	}
+
+	const int level = std::max(0, std::min(ch.priority_, PRIORITY_LEVELS - 1));
+	if (h->pending[level].empty()) {
+		ready_[level].push_back(h);
+	}
+	h->pending[level].push_back(&ch);
+	++h->num_pending;
+	++num_pending_;
+
+	ch.queued_ = true;
+	ch.SetInFlight(true);
+	CountHandle();
+}
+
+// takes a handle out of its host's queue, whatever level it's on
+void MultiHandle::UnqueueHandle(EasyHandle& ch) {
+	HostQueue* h = hosts_[ch.host_];
+	assert(h != NULL);
+
+	for (int level = 0; level < PRIORITY_LEVELS; ++level) {
+		std::deque<EasyHandle*>& pending = h->pending[level];
+		std::deque<EasyHandle*>::iterator it = std::find(pending.begin(), pending.end(), &ch);
+		if (it == pending.end()) {
+			continue;
+		}
+
+		pending.erase(it);
+		if (pending.empty()) {
+			ReadyHosts& ready = ready_[level];
+			const size_t i = std::find(ready.begin(), ready.end(), h) - ready.begin();
+			ready.erase(ready.begin() + i);
+			if (cursors_[level] > i) {
+				--cursors_[level];
+			}
+		}
+		break;
+	}
+
+	--h->num_pending;
+	--num_pending_;
+	ch.queued_ = false;
+	DropHostIfIdle(h);
+}
+
+// stops a transfer and delivers its completion with CURLE_ABORTED_BY_CALLBACK
+// right away; a transfer that's done already and only waits for its callback
+// is left alone
+void MultiHandle::Abort(EasyHandle& ch) {
+	if (ch.queued_) {
+		UnqueueHandle(ch);
+	}
+	else if (ch.in_multi_) {
+		curl_multi_remove_handle(mh_, ch);
+		ch.in_multi_ = false;
+		ReleaseHost(ch);
+		--num_active_;
+	}
+	else {
+		return;
+	}
+
+	Completion c = { &ch, CURLE_ABORTED_BY_CALLBACK };
+	DeliverCompletions(Completions(1, c));
+
+	AdmitPending(); // there's room now
+}
+
+// adds queued handles to libcurl for as long as the limits allow, true if
+// anything was added; handles libcurl refuses are completed with an error
+bool MultiHandle::Admit() {
+	const double now = ev_now();
+	double wait = -1;
+	bool admitted = false;
+	Completions failed;
+
+	admitting_ = true;
+	while (num_pending_ > 0 && (max_in_flight_ == 0 || num_active_ < max_in_flight_)) {
+		EasyHandle* ch = NextHandle(now, &wait);
+		if (ch == NULL) {
+			break;
+		}
+
+		if (AddHandle(*ch) == CURLM_OK) {
+			admitted = true;
+		}
+		else {
+			ReleaseHost(*ch);
+			Completion c = { ch, CURLE_FAILED_INIT };
+			failed.push_back(c);
+		}
+	}
+	admitting_ = false;
+
+	// wake up when the first token bucket has a token again
+	ev_timer_stop(&admit_timer_);
+	if (num_pending_ > 0 && wait >= 0) {
+		ev_timer_set(&admit_timer_, wait, 0.);
+		ev_timer_start(&admit_timer_);
+	}
+
+	if (!failed.empty()) {
+		DeliverCompletions(failed);
+	}
+
+	return admitted;
+}
+
+// picks the level by weighted round-robin, then the next host of that level
+// that is below its limits; `wait` is lowered to the time until a rate
+// limited host can go again
+EasyHandle* MultiHandle::NextHandle(double now, double* wait) {
+	for (int round = 0; round < 2; ++round) {
+		bool out_of_credits = false;
+
+		for (int level = 0; level < PRIORITY_LEVELS; ++level) {
+			ReadyHosts& ready = ready_[level];
+			if (ready.empty()) {
+				continue;
+			}
+			if (credits_[level] == 0) {
+				out_of_credits = true;
+				continue;
+			}
+
+			for (size_t n = 0; n < ready.size(); ++n) {
+				const size_t i = (cursors_[level] + n) % ready.size();
+				HostQueue* h = ready[i];
+				if (!Admissible(*h, now, wait)) {
+					continue;
+				}
+
+				EasyHandle* ch = h->pending[level].front();
+				h->pending[level].pop_front();
+				ch->queued_ = false;
+				--h->num_pending;
+				--num_pending_;
+
+				if (h->pending[level].empty()) {
+					ready.erase(ready.begin() + i);
+					cursors_[level] = i;
+				}
+				else {
+					cursors_[level] = i + 1;
+				}
+
+				--credits_[level];
+				++h->in_flight;
+				if (host_rate_ > 0) {
+					h->tokens -= 1;
+				}
+				ch->host_queue_ = h;
+
+				return ch;
+			}
+		}
+
+		if (!out_of_credits) {
+			break;
+		}
+
+		// a new round
+		std::copy(weights_, weights_ + PRIORITY_LEVELS, credits_);
+	}
+
+	return NULL;
+}
+
+bool MultiHandle::Admissible(HostQueue& h, double now, double* wait) {
+	if (max_host_in_flight_ > 0 && h.in_flight >= max_host_in_flight_) {
+		return false; // retried when one of its transfers finishes
+	}
+
+	if (host_rate_ > 0) {
+		h.Refill(now, host_rate_, host_burst_);
+		if (h.tokens < 1) {
+			const double w = (1 - h.tokens) / host_rate_;
+			if (*wait < 0 || w < *wait) {
+				*wait = w;
+			}
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void MultiHandle::ReleaseHost(EasyHandle& ch) {
+	HostQueue* h = ch.host_queue_;
+	if (h != NULL) {
+		ch.host_queue_ = NULL;
+		--h->in_flight;
+		DropHostIfIdle(h);
+	}
+}
+
+// hosts are forgotten once nothing runs or waits for them and their token
+// bucket is full again
+void MultiHandle::DropHostIfIdle(HostQueue* h) {
+	if (h->in_flight > 0 || h->num_pending > 0) {
+		return;
+	}
+
+	if (host_rate_ > 0) {
+		h->Refill(ev_now(), host_rate_, host_burst_);
+		if (h->tokens < host_burst_) {
+			return;
+		}
+	}
+
+	hosts_.erase(h->name);
+	delete h;
+}
+
+// hosts whose bucket was still filling up when their last transfer finished
+// aren't looked at again, sweep them once the map has doubled in size
+void MultiHandle::SweepHosts() {
+	for (Hosts::iterator it = hosts_.begin(); it != hosts_.end();) {
+		HostQueue* h = it->second;
+		++it; // h may go
+		DropHostIfIdle(h);
+	}
+
+	sweep_at_ = std::max<size_t>(SWEEP_MIN, 2 * hosts_.size());
+}
+
+void MultiHandle::AdmitPending() {
+	if (num_pending_ > 0 && !admitting_ && Admit()) {
+		ProcessEvents(CURL_SOCKET_TIMEOUT, 0);
+	}
+}
+
+void MultiHandle::AdmitTimerFunction(ev_timer* w, int /*events*/) {
+	MultiHandle& self = *reinterpret_cast<MultiHandle*>(w->data);
+
+	TRACE("%s: pending=%u", __func__, self.num_pending_);
+	self.AdmitPending();
+}
+
+// 0 for no limit
+void MultiHandle::SetMaxInFlight(unsigned max) {
+	max_in_flight_ = max;
+	AdmitPending();
+}
+
+void MultiHandle::SetMaxHostInFlight(unsigned max) {
+	max_host_in_flight_ = max;
+	AdmitPending();
+}
+
+// transfers per second, 0 for no limit
+void MultiHandle::SetHostRate(double rate) {
+	host_rate_ = rate;
+	AdmitPending();
+}
+
+// how many transfers a host can start back to back, at least one
+void MultiHandle::SetHostBurst(double burst) {
+	host_burst_ = std::max(1., burst);
+}
+
+// how many handles each level gets per round, at least one
+void MultiHandle::SetPriorityWeights(const unsigned* weights) {
+	for (int i = 0; i < PRIORITY_LEVELS; ++i) {
+		weights_[i] = credits_[i] = std::max(1u, weights[i]);
+	}
+}
+
+//
+// WorkerPool implementation
+//
+Handle<Object> WorkerPool::New(unsigned num_threads) {
+	WorkerPool* const pool = new WorkerPool();
+
+	// glue C++ object to a V8-managed JS object
+	Local<Object> handle = workerPoolTemplate->NewInstance();
+	handle->SetPointerInInternalField(1, reinterpret_cast<void*>(&workerPoolTemplate)); // magic cookie
+	pool->Wrap(handle);
+
+	if (!pool->Start(num_threads)) {
+		Error("Cannot start worker threads.");
+	}
+
+	return pool->handle_;
+}
+
+bool WorkerPool::IsInstanceOf(Handle<Value> val) {
+	if (val->IsObject()) {
+		Local<Object> o = val->ToObject();
+		return o->InternalFieldCount() >= 2
+			&& o->GetPointerFromInternalField(1) == reinterpret_cast<void*>(&workerPoolTemplate);
+	}
+	else {
+		return false;
+	}
+}
+
+WorkerPool* WorkerPool::Unwrap(Handle<Value> handle) {
+	if (IsInstanceOf(handle)) {
+		return ObjectWrap::Unwrap<WorkerPool>(handle->ToObject());
+	}
+	else {
+		return NULL;
+	}
+}
+
+WorkerPool::WorkerPool(): next_worker_(0), num_handles_(0) {
+	ev_async_init(&async_, AsyncEventFunction);
+	async_.data = reinterpret_cast<void*>(this);
+	ev_async_start(&async_);
+	ev_unref(); // only in-flight transfers keep the loop alive
+}
+
+// pinned while there are transfers in flight, the workers are idle by now
+WorkerPool::~WorkerPool() {
+	assert(num_handles_ == 0);
+	Stop();
+
+	ev_ref();
+	ev_async_stop(&async_);
+}
+
+bool WorkerPool::Start(unsigned num_threads) {
+	for (unsigned i = 0; i < num_threads; ++i) {
+		Worker* w = new Worker();
+		w->pool = this;
+		w->quit = false;
+		w->mh = curl_multi_init();
+
+		if (w->mh == NULL || pipe(w->wakefds) == -1) {
+			if (w->mh != NULL) {
+				curl_multi_cleanup(w->mh);
+			}
+			delete w;
+			return false;
+		}
+		fcntl(w->wakefds[0], F_SETFL, O_NONBLOCK);
+		fcntl(w->wakefds[1], F_SETFL, O_NONBLOCK);
+
+		if (pthread_create(&w->thread, NULL, ThreadMain, w) != 0) {
+			close(w->wakefds[0]);
+			close(w->wakefds[1]);
+			curl_multi_cleanup(w->mh);
+			delete w;
+			return false;
+		}
+
+		workers_.push_back(w);
+	}
+
+	return !workers_.empty();
+}
+
+void WorkerPool::Stop() {
+	for (std::vector<Worker*>::iterator it = workers_.begin(); it != workers_.end(); ++it) {
+		Worker* w = *it;
+
+		w->quit = true;
+		Wake(*w);
+		pthread_join(w->thread, NULL);
+
+		close(w->wakefds[0]);
+		close(w->wakefds[1]);
+		curl_multi_cleanup(w->mh);
+		delete w;
+	}
+	workers_.clear();
+}
+
+Handle<Value> WorkerPool::Add(EasyHandle& ch) {
+	return AddMany(EasyHandles(1, &ch));
+}
+
+// all or nothing, the handles are checked before any of them is queued;
+// CURLOPT_NOSIGNAL stays set on the handles afterwards and a handle without
+// a write mode keeps discarding the body, curl_easy_reset() undoes both
+Handle<Value> WorkerPool::AddMany(const EasyHandles& handles) {
+	if (workers_.empty()) {
+		return Error("Worker pool has no threads.");
+	}
+
+	for (EasyHandles::const_iterator it = handles.begin(); it != handles.end(); ++it) {
+		if (!(*it)->CanRunOffThread()) {
+			return Error("Handles with JS callbacks or a share handle can't run on a worker pool.");
+		}
+		if ((*it)->IsInFlight()) {
+			return Error("Handle is already in use.");
+		}
+	}
+	if (HasDuplicates(handles)) {
+		return Error("The same handle can't be added twice.");
+	}
+
+	std::vector<bool> has_jobs(workers_.size(), false);
+
+	for (EasyHandles::const_iterator it = handles.begin(); it != handles.end(); ++it) {
+		EasyHandle& ch = **it;
+
+		// signals are per process, they don't mix with threads
+		curl_easy_setopt(ch, CURLOPT_NOSIGNAL, 1L);
+
+		// libcurl's default write function prints the body to stdout, Write()
+		// discards it when there's no file or accumulate mode
+		curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, BodyFunction);
+		curl_easy_setopt(ch, CURLOPT_WRITEDATA, &ch);
+
+		ch.SetInFlight(true);
+		ch.off_thread_ = true;
+
+		if (++num_handles_ == 1) {
+			ev_ref();
+			Ref();
+		}
+
+		workers_[next_worker_]->jobs.Push(&ch);
+		has_jobs[next_worker_] = true;
+		next_worker_ = (next_worker_ + 1) % workers_.size();
+	}
+
+	// wake up each worker that got a job once
+	for (size_t i = 0; i < workers_.size(); ++i) {
+		if (has_jobs[i]) {
+			Wake(*workers_[i]);
+		}
+	}
+
+	return Undefined();
+}
+
+void WorkerPool::Wake(Worker& w) {
+	const char c = 0;
+	while (write(w.wakefds[1], &c, 1) == -1 && errno == EINTR);
+}
+
+// blocks until libcurl has something to do or the thread is woken up
+void WorkerPool::Wait(Worker& w) {
+	long timeout = -1;
+	curl_multi_timeout(w.mh, &timeout);
+	if (timeout < 0 || timeout > 1000) {
+		timeout = 1000;
+	}
+
+#if LIBCURL_VERSION_NUM >= 0x071c00
+	struct curl_waitfd wakefd = { w.wakefds[0], CURL_WAIT_POLLIN, 0 };
+	curl_multi_wait(w.mh, &wakefd, 1, timeout, NULL);
+#else
+	fd_set readfds, writefds, exceptfds;
+	int maxfd = -1;
+
+	FD_ZERO(&readfds);
+	FD_ZERO(&writefds);
+	FD_ZERO(&exceptfds);
+	curl_multi_fdset(w.mh, &readfds, &writefds, &exceptfds, &maxfd);
+
+	FD_SET(w.wakefds[0], &readfds);
+	if (w.wakefds[0] > maxfd) {
+		maxfd = w.wakefds[0];
+	}
+
+	struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+	select(maxfd + 1, &readfds, &writefds, &exceptfds, &tv);
+#endif
+
+	char buf[64];
+	while (read(w.wakefds[0], buf, sizeof buf) > 0);
+}
+
+void* WorkerPool::ThreadMain(void* arg) {
+	Worker& w = *reinterpret_cast<Worker*>(arg);
+
+	while (!w.quit) {
+		for (EasyHandle* ch = w.jobs.TakeAll(); ch != NULL; ) {
+			EasyHandle* next = ch->next_job_;
+			CURLMcode status = curl_multi_add_handle(w.mh, *ch);
+			if (status != CURLM_OK) {
+				ch->result_ = CURLE_FAILED_INIT;
+				w.pool->done_.Push(ch);
+				ev_async_send(&w.pool->async_);
+			}
+			ch = next;
+		}
+
+		int running_handles = 0;
+		while (curl_multi_perform(w.mh, &running_handles) == CURLM_CALL_MULTI_PERFORM);
+
+		int msgs_in_queue = 0;
+		bool done = false;
+		CURLMsg *msg;
+
+		while ((msg = curl_multi_info_read(w.mh, &msgs_in_queue))) {
+			if (msg->msg == CURLMSG_DONE) {
+				EasyHandle* ch = EasyHandle::FromCURL(msg->easy_handle);
+				ch->result_ = ch->FinishWriteFile(msg->data.result);
+				TRACE("%s: done, result=%d", __func__, ch->result_);
+				curl_multi_remove_handle(w.mh, msg->easy_handle);
+				w.pool->done_.Push(ch);
+				done = true;
+			}
+		}
+
+		if (done) {
+			ev_async_send(&w.pool->async_);
+		}
+
+		Wait(w);
+	}
+
+	return NULL;
+}
+
+// runs in the main thread, delivers the transfers the workers finished
+void WorkerPool::AsyncEventFunction(ev_async* w, int /*events*/) {
+	WorkerPool& self = *reinterpret_cast<WorkerPool*>(w->data);
+
+	// copied out first, a callback that queues a handle again reuses its
+	// next_job_ link for a worker's queue
+	EasyHandles done;
+	for (EasyHandle* ch = self.done_.TakeAll(); ch != NULL; ch = ch->next_job_) {
+		done.push_back(ch);
+	}
+	const size_t num_done = done.size();
+
+	HandleScope scope;
+
+	// in flight until its own callback, like in MultiHandle::DeliverCompletions()
+	for (EasyHandles::iterator it = done.begin(); it != done.end(); ++it) {
+		(*it)->off_thread_ = false;
+		(*it)->SetInFlight(false);
+		(*it)->InvokeCompleteCallback((*it)->result_);
+		(*it)->Unpin();
+	}
+
+	// like MultiHandle::DeliverCompletions(), account for the handles only now
+	assert(self.num_handles_ >= num_done);
+	self.num_handles_ -= num_done;
+
+	if (num_done > 0 && self.num_handles_ == 0) {
+		ev_unref();
+		self.Unref();
+	}
+}
+
+WorkerPool::JobQueue::JobQueue(): head_(NULL) {
+}
+
+void WorkerPool::JobQueue::Push(EasyHandle* ch) {
+	EasyHandle* head;
+	do {
+		head = head_;
+		ch->next_job_ = head;
+	}
+	while (!__sync_bool_compare_and_swap(&head_, head, ch));
+}
+
+EasyHandle* WorkerPool::JobQueue::TakeAll() {
+	EasyHandle* head;
+	do {
+		head = head_;
+	}
+	while (!__sync_bool_compare_and_swap(&head_, head, static_cast<EasyHandle*>(NULL)));
+
+	// the stack is newest first, reverse it
+	EasyHandle* list = NULL;
+	while (head != NULL) {
+		EasyHandle* next = head->next_job_;
+		head->next_job_ = list;
+		list = head;
+		head = next;
+	}
+
+	return list;
+}
+
+//
+// DnsCache implementation
+//
+DnsCache::Entries DnsCache::entries_;
+double DnsCache::ttl_ = 60;
+unsigned DnsCache::num_threads_ = 0;
+pthread_mutex_t DnsCache::lock_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t DnsCache::wakeup_ = PTHREAD_COND_INITIALIZER;
+
+double DnsCache::Now() {
+	return MonotonicNanos() / 1e9;
+}
+
+// `host_port` is "host:port"
+void DnsCache::Prefetch(const std::string& host_port) {
+	pthread_mutex_lock(&lock_);
+	if (entries_.find(host_port) == entries_.end()) {
+		Queue(host_port, Now());
+	}
+	pthread_mutex_unlock(&lock_);
+}
+
+// false if the host isn't resolved (yet), it's queued then
+bool DnsCache::Lookup(const std::string& host_port, std::string* addrs) {
+	bool found = false;
+	const double now = Now();
+
+	pthread_mutex_lock(&lock_);
+	Entries::iterator it = entries_.find(host_port);
+	if (it == entries_.end()) {
+		Queue(host_port, now);
+	}
+	else {
+		it->second.last_used = now;
+		if (now < it->second.expires && !it->second.addrs.empty()) {
+			*addrs = it->second.addrs;
+			found = true;
+		}
+	}
+	pthread_mutex_unlock(&lock_);
+
+	return found;
+}
+
+void DnsCache::SetTTL(double ttl) {
+	pthread_mutex_lock(&lock_);
+	ttl_ = ttl;
+	pthread_cond_signal(&wakeup_);
+	pthread_mutex_unlock(&lock_);
+}
+
+// with lock_ held
+void DnsCache::Queue(const std::string& host_port, double now) {
+	Start();
+	Entry e = { std::string(), 0, 0, now, false };
+	entries_.insert(std::make_pair(host_port, e));
+	pthread_cond_signal(&wakeup_);
+}
+
+// with lock_ held, a thread per new host up to MAX_THREADS
+void DnsCache::Start() {
+	if (num_threads_ < MAX_THREADS && num_threads_ < entries_.size() + 1) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, ThreadMain, NULL) == 0) {
+			pthread_detach(thread);
+			++num_threads_;
+		}
+	}
+}
+
+// picks whatever is unresolved or within 10% of its TTL of expiring and
+// resolves it without holding the lock, sleeps until the next entry is due
+// otherwise
+void* DnsCache::ThreadMain(void* /*arg*/) {
+	pthread_mutex_lock(&lock_);
+
+	for (;;) {
+		const double now = Now();
+		double next = now + ttl_;
+		std::string due;
+		bool more = false;
+
+		for (Entries::iterator it = entries_.begin(); it != entries_.end();) {
+			Entry& e = it->second;
+			if (!e.resolving && now - e.last_used > 4 * ttl_) {
+				entries_.erase(it++);
+				continue;
+			}
+			const double refresh = std::max(e.expires - 0.1 * ttl_, e.retry);
+			if (e.resolving) {
+				// another thread has it
+			}
+			else if (refresh > now) {
+				next = std::min(next, refresh);
+			}
+			else if (due.empty()) {
+				due = it->first;
+				e.resolving = true;
+			}
+			else {
+				more = true;
+			}
+			++it;
+		}
+
+		if (more) {
+			pthread_cond_signal(&wakeup_); // for another thread
+		}
+
+		if (due.empty()) {
+			const double wait = next - now;
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += static_cast<time_t>(wait);
+			ts.tv_nsec += static_cast<long>((wait - static_cast<time_t>(wait)) * 1e9);
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec += 1;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&wakeup_, &lock_, &ts);
+			continue;
+		}
+
+		pthread_mutex_unlock(&lock_);
+		std::string addrs;
+		const bool ok = Resolve(due, &addrs);
+		TRACE("%s: %s -> %s", __func__, due.c_str(), ok ? addrs.c_str() : "(failed)");
+		pthread_mutex_lock(&lock_);
+
+		Entries::iterator it = entries_.find(due);
+		if (it != entries_.end()) {
+			it->second.resolving = false;
+			if (ok) {
+				it->second.addrs = addrs;
+				it->second.expires = Now() + ttl_;
+				it->second.retry = 0;
+			}
+			else {
+				// keep serving what we had until it expires, retry in a second
+				it->second.retry = Now() + 1;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+bool DnsCache::Resolve(const std::string& host_port, std::string* addrs) {
+	const size_t colon = host_port.rfind(':');
+	if (colon == std::string::npos) {
+		return false;
+	}
+	const std::string host = host_port.substr(0, colon);
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo* result;
+	if (getaddrinfo(host.c_str(), NULL, &hints, &result) != 0) {
+		return false;
+	}
+
+	addrs->clear();
+	for (struct addrinfo* ai = result; ai != NULL; ai = ai->ai_next) {
+		char buf[INET6_ADDRSTRLEN + 2];
+		if (ai->ai_family == AF_INET) {
+			inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in*>(ai->ai_addr)->sin_addr, buf, sizeof(buf));
+		}
+#if LIBCURL_VERSION_NUM >= 0x073b00
+		// older versions take a single address, and IPv4 is the safe bet
+		else if (ai->ai_family == AF_INET6) {
+			buf[0] = '[';
+			inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6*>(ai->ai_addr)->sin6_addr, buf + 1, sizeof(buf) - 2);
+			strcat(buf, "]");
+		}
+#endif
+		else {
+			continue;
+		}
+
+		if (!addrs->empty()) {
+			addrs->push_back(',');
+		}
+		addrs->append(buf);
+#if LIBCURL_VERSION_NUM < 0x073b00
+		break;
+#endif
+	}
+	freeaddrinfo(result);
+
+	return !addrs->empty();
+}
+
+//
+// Progress implementation
+//
+std::vector<EasyHandle*> Progress::handles_;
+Persistent<Function> Progress::callback_;
+ev_timer Progress::timer_;
+double Progress::interval_ = 0.25;
+
+// `callback` is called with an array of handles and a flat array with
+// [dlnow, dltotal, ulnow, ultotal] for each of them, null turns it off
+void Progress::SetCallback(Handle<Value> callback, double interval) {
+	callback_.Dispose();
+	callback_.Clear();
+
+	if (callback->IsFunction()) {
+		callback_ = Persistent<Function>::New(Handle<Function>::Cast(callback));
+	}
+	interval_ = interval;
+
+	static bool initialized = false;
+	if (!initialized) {
+		ev_init(&timer_, TimerFunction);
+		initialized = true;
+	}
+	Update();
+}
+
+void Progress::Watch(EasyHandle* ch) {
+	ch->progress_index_ = handles_.size();
+	ch->progress_watched_ = true;
+	handles_.push_back(ch);
+	Update();
+}
+
+// the last handle takes the place of the one that goes
+void Progress::Unwatch(EasyHandle* ch) {
+	EasyHandle* last = handles_.back();
+	handles_[ch->progress_index_] = last;
+	last->progress_index_ = ch->progress_index_;
+	handles_.pop_back();
+	ch->progress_watched_ = false;
+	Update();
+}
+
+// the timer only runs while there's something to report, and it doesn't
+// keep the loop alive
+void Progress::Update() {
+	const bool run = !handles_.empty() && !callback_.IsEmpty();
+
+	if (run && !ev_is_active(&timer_)) {
+		ev_timer_set(&timer_, interval_, interval_);
+		ev_timer_start(&timer_);
+		ev_unref();
+	}
+	else if (!run && ev_is_active(&timer_)) {
+		ev_ref();
+		ev_timer_stop(&timer_);
+	}
+	else if (run && timer_.repeat != interval_) {
+		timer_.repeat = interval_;
+		ev_timer_again(&timer_);
+	}
+}
+
+void Progress::TimerFunction(ev_timer* /*w*/, int /*events*/) {
+	HandleScope scope;
+
+	Local<Array> handles = Array::New();
+	Local<Array> values = Array::New();
+	unsigned n = 0;
+
+	for (std::vector<EasyHandle*>::iterator it = handles_.begin(); it != handles_.end(); ++it) {
+		EasyHandle* ch = *it;
+		if (!ch->progress_dirty_) {
+			continue;
+		}
+		ch->progress_dirty_ = false;
+
+		handles->Set(n, ch->handle_);
+		for (int i = 0; i < 4; ++i) {
+			values->Set(4 * n + i, Number::New(ch->progress_values_[i]));
+		}
+		++n;
+	}
+
+	if (n == 0) {
+		return;
+	}
+
+	TryCatch tc;
+
+	Local<Function> callback = Local<Function>::New(callback_);
+	Handle<Value> args[] = { handles, values };
+	callback->Call(Context::GetCurrent()->Global(), 2, args);
+
+	if (tc.HasCaught()) {
+		FatalException(tc);
+	}
+}
+
+//
+// Download implementation
+//
+// `fd` is the download's from now on, closed when it's done
+Handle<Value> Download::Start(Handle<Value> url, int fd, unsigned segments,
+	Handle<Array> options, Handle<Value> callback, MultiHandle* mh)
+{
+	Download* const d = new Download(fd, segments, mh);
+	d->url_ = Persistent<Value>::New(url);
+	d->options_ = Persistent<Array>::New(options);
+	d->callback_ = Persistent<Function>::New(Local<Function>(Function::Cast(*callback)));
+
+	Segment* probe;
+	{
+		TryCatch tc;
+
+		probe = d->NewSegment(0, 0);
+		if (probe == NULL) {
+			delete d;
+			return tc.ReThrow();
+		}
+	}
+
+	d->probing_ = true;
+	++d->active_;
+	Handle<Value> error = d->Perform(probe);
+	if (!error.IsEmpty()) {
+		delete d;
+		return ThrowException(error);
+	}
+	d->Release(); // the probe may be done already, if it failed outright
+
+	return Undefined();
+}
+
+Download::Download(int fd, unsigned segments, MultiHandle* mh):
+	fd_(fd), num_segments_(std::min<unsigned>(segments, MAX_SEGMENTS)), mh_(mh), multi_(Persistent<Object>::New(mh->handle_)),
+	active_(0), probing_(false), bytes_(0)
+{
+	ev_init(&finish_timer_, FinishTimerFunction);
+	finish_timer_.data = reinterpret_cast<void*>(this);
+}
+
+Download::~Download() {
+	for (std::vector<Segment*>::iterator it = segments_.begin(); it != segments_.end(); ++it) {
+		if (!(*it)->ch->IsClosed()) {
+			(*it)->ch->Close();
+		}
+		(*it)->handle.Dispose();
+		delete *it;
+	}
+	close(fd_);
+	ev_timer_stop(&finish_timer_);
+
+	multi_.Dispose();
+	url_.Dispose();
+	options_.Dispose();
+	callback_.Dispose();
+	error_.Dispose();
+}
+
+// a handle for bytes `start` through `end`, NULL with an exception pending
+// when the options don't take
+Download::Segment* Download::NewSegment(curl_off_t start, curl_off_t end) {
+	Handle<Object> handle = EasyHandle::New();
+	if (!EasyHandle::IsInstanceOf(handle)) {
+		return NULL;
+	}
+	EasyHandle* ch = EasyHandle::Unwrap(handle);
+
+	TryCatch tc;
+
+	SetOption(ch, CURLOPT_URL, url_);
+	for (uint32_t i = 0; i < options_->Length() && !tc.HasCaught(); i += 2) {
+		SetOption(ch, (CURLoption) options_->Get(i)->Int32Value(), options_->Get(i + 1));
+	}
+	SetOption(ch, (CURLoption) NODECURLOPT_WRITEFILE, Integer::New(fd_));
+	SetOption(ch, (CURLoption) NODECURLOPT_HEADERS, True()); // for the range check
+
+	if (tc.HasCaught()) {
+		ch->Close();
+		tc.ReThrow();
+		return NULL;
+	}
+
+	Segment* const s = new Segment();
+	s->download = this;
+	s->ch = ch;
+	s->handle = Persistent<Object>::New(handle);
+	s->start = start;
+	s->end = end;
+	s->retries = MAX_RETRIES;
+	segments_.push_back(s);
+
+	ch->SetCompleteHook(CompleteFunction, s);
+
+	return s;
+}
+
+// (re)starts the transfer where the segment stands, an empty handle or the
+// exception that got in the way
+Handle<Value> Download::Perform(Segment* s) {
+	char range[64];
+	if (s->end >= 0) {
+		snprintf(range, sizeof(range), "%" CURL_FORMAT_CURL_OFF_T "-%" CURL_FORMAT_CURL_OFF_T, s->start, s->end);
+	}
+	else {
+		snprintf(range, sizeof(range), "%" CURL_FORMAT_CURL_OFF_T "-", s->start);
+	}
+	curl_easy_setopt(*s->ch, CURLOPT_RANGE, s->start > 0 || s->end >= 0 ? range : NULL);
+	s->ch->SetWriteFileOffset(s->start);
+	// nothing but the bytes asked for go into the file, the probe also takes a
+	// whole body from a server that doesn't do ranges
+	s->ch->SetExpectedRange(s->start, probing_);
+	s->ch->PrepareTransfer();
+
+	TryCatch tc;
+
+	// counted first, the transfer may be over before Add() returns
+	++active_;
+	mh_->Add(*s->ch);
+
+	if (tc.HasCaught()) {
+		--active_;
+		return tc.Exception();
+	}
+
+	return Handle<Value>();
+}
+
+// the probe got its byte, the rest of the object is split up and `s` takes
+// the first part; the size comes from the probe's Content-Range
+void Download::Split(Segment* s) {
+	curl_off_t size = -1;
+
+	size_t len;
+	const char* range = s->ch->GetHeaders().Find("content-range", &len); // "bytes 0-0/size"
+	if (range != NULL) {
+		const char* slash = static_cast<const char*>(memchr(range, '/', len));
+		if (slash != NULL && slash + 1 < range + len && isdigit(static_cast<unsigned char>(slash[1]))) {
+			size = strtoll(slash + 1, NULL, 10);
+		}
+	}
+
+	if (size < 0) {
+		// no size, no segments; fetch the rest in one go
+		s->end = -1;
+	}
+	else {
+		int status = posix_fallocate(fd_, 0, size);
+		if (status == EINVAL || status == EOPNOTSUPP) {
+			status = ftruncate(fd_, size) == 0 ? 0 : errno;
+		}
+		if (status != 0) {
+			Fail(Exception::Error(String::New(strerror(status))));
+			return;
+		}
+
+		const curl_off_t rest = size - s->start;
+		if (rest <= 0) {
+			s->ch->Close();
+			return;
+		}
+
+		const curl_off_t n = std::min<curl_off_t>(num_segments_, rest);
+		const curl_off_t part = (rest + n - 1) / n;
+		s->end = s->start + part - 1;
+
+		TryCatch tc;
+
+		for (curl_off_t start = s->end + 1; start < size; start += part) {
+			Segment* t = NewSegment(start, std::min(start + part, size) - 1);
+			Handle<Value> error = t != NULL ? Perform(t) : tc.Exception();
+			if (!error.IsEmpty()) {
+				Fail(error);
+				return;
+			}
+		}
+	}
+
+	Handle<Value> error = Perform(s);
+	if (!error.IsEmpty()) {
+		Fail(error);
+	}
+}
+
+void Download::Complete(Segment* s, CURLcode result, curl_off_t size) {
+	HandleScope scope;
+
+	long status = 0;
+	curl_easy_getinfo(*s->ch, CURLINFO_RESPONSE_CODE, &status);
+
+	// only a 206 wrote where it was supposed to
+	if (status == 206) {
+		s->start += size;
+		bytes_ += size;
+	}
+	// what's in the file counts, even if the transfer failed after that
+	const bool done = status == 206 && (s->end >= 0 ? s->start > s->end : result == CURLE_OK);
+
+	if (!error_.IsEmpty()) {
+		// the download failed already, aborted or done anyway
+		s->ch->Close();
+	}
+	else if (probing_ && (done || status == 416)) {
+		// 416 and "bytes */0" for an empty object
+		probing_ = false;
+		Split(s);
+	}
+	else if (done) {
+		s->ch->Close();
+	}
+	else if (probing_ && result == CURLE_OK && status / 100 == 2 && status != 206) {
+		// the whole body in one go
+		probing_ = false;
+		bytes_ += size;
+		s->ch->Close();
+	}
+	else if (status != 0 && status != 206 && status < 500) {
+		// the body was refused, it's not coming back on a retry
+		char message[64];
+		snprintf(message, sizeof(message), "Unexpected HTTP status %ld.", status);
+		Fail(Exception::Error(String::New(message)));
+	}
+	else if (s->retries > 0) {
+		--s->retries;
+		Handle<Value> error = Perform(s);
+		if (!error.IsEmpty()) {
+			Fail(error);
+		}
+	}
+	else if (result != CURLE_OK) {
+		Local<Object> error = Exception::Error(String::New(curl_easy_strerror(result)))->ToObject();
+		error->Set(String::NewSymbol("code"), Integer::New(result));
+		Fail(error);
+	}
+	else {
+		char message[64];
+		snprintf(message, sizeof(message), "Unexpected HTTP status %ld.", status);
+		Fail(Exception::Error(String::New(message)));
+	}
+
+	Release();
+}
+
+// the segments in flight are aborted, the callback gets the first error
+void Download::Fail(Handle<Value> error) {
+	if (!error_.IsEmpty()) {
+		return;
+	}
+	error_ = Persistent<Value>::New(error);
+
+	// their completions come in right away, the caller still holds active_
+	for (size_t i = 0; i < segments_.size(); ++i) {
+		if (segments_[i]->ch->IsInFlight()) {
+			mh_->Abort(*segments_[i]->ch);
+		}
+	}
+}
+
+// once the last segment is done the callback is scheduled, so that it never
+// runs from inside curl_easy_download()
+void Download::Release() {
+	if (--active_ == 0) {
+		ev_timer_set(&finish_timer_, 0., 0.);
+		ev_timer_start(&finish_timer_);
+	}
+}
+
+// calls the callback with a null or Error argument and the number of bytes
+// written, then it's gone
+void Download::Finish() {
+	HandleScope scope;
+
+	Local<Function> callback = Local<Function>::New(callback_);
+	Handle<Value> error = Null();
+	if (!error_.IsEmpty()) {
+		error = Local<Value>::New(error_);
+	}
+	Handle<Value> args[] = { error, Number::New(bytes_) };
+
+	delete this;
+
+	TryCatch tc;
+
+	callback->Call(Context::GetCurrent()->Global(), 2, args);
+
+	if (tc.HasCaught()) {
+		FatalException(tc);
+	}
+}
+
+void Download::CompleteFunction(EasyHandle* /*ch*/, CURLcode result, curl_off_t size, void* data) {
+	Segment* s = reinterpret_cast<Segment*>(data);
+	s->download->Complete(s, result, size);
+}
+
+void Download::FinishTimerFunction(ev_timer* w, int /*events*/) {
+	reinterpret_cast<Download*>(w->data)->Finish();
+}
+
+//
+// helpers
+//
+
+// takes a copy, it's sorted
+bool HasDuplicates(EasyHandles handles) {
+	std::sort(handles.begin(), handles.end());
+	return std::adjacent_find(handles.begin(), handles.end()) != handles.end();
+}
+
+// no V8 in here, this runs on the worker threads too
+size_t BodyFunction(char* data, size_t size, size_t nmemb, void* arg) {
+	EasyHandle* ch = reinterpret_cast<EasyHandle*>(arg);
+
+	return ch->Write(data, size * nmemb);
+}
+
+// no V8 in here either
+#if LIBCURL_VERSION_NUM >= 0x072000
+int XferInfoFunction(void* arg, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+	EasyHandle* ch = reinterpret_cast<EasyHandle*>(arg);
+
+	ch->UpdateProgress(dltotal, dlnow, ultotal, ulnow);
+
+	return 0;
+}
+#else
+int ProgressFunction(void* arg, double dltotal, double dlnow, double ultotal, double ulnow) {
+	EasyHandle* ch = reinterpret_cast<EasyHandle*>(arg);
+
+	ch->UpdateProgress(dltotal, dlnow, ultotal, ulnow);
+
+	return 0;
+}
+#endif
+
+// no V8 in here either
+size_t HeaderFunction(char* data, size_t size, size_t nmemb, void* arg) {
+	EasyHandle* ch = reinterpret_cast<EasyHandle*>(arg);
+
+	ch->ParseHeader(data, size * nmemb);
+
+	return size * nmemb;
+}
+
+size_t ReadFunction(char* data, size_t size, size_t nmemb, void* arg) {
+	EasyHandle* ch = reinterpret_cast<EasyHandle*>(arg);
+
+	TryCatch tc;
+
+	const size_t nread = ch->Read(data, size * nmemb);
+
+	if (tc.HasCaught()) {
+		FatalException(tc);
+		return CURL_READFUNC_ABORT;
+	}
+
+	return nread;
+}
+
+size_t WriteFunction(char* data, size_t size, size_t nmemb, void* arg) {
+	EasyHandle* ch = reinterpret_cast<EasyHandle*>(arg);
+
+	TryCatch tc;
+
+	const size_t nwritten = ch->Write(data, size * nmemb);
+
+	if (tc.HasCaught()) {
+		FatalException(tc);
+		return 0;
+	}
+
+	return nwritten;
+}
+
+//
+// option table
+//
+// The options that take a plain value and the type of that value, options
+// that need more work (callbacks, handles, node-curl's own) are dealt with
+// in SetOption(). Sorted once at startup so lookups can bisect.
+//
+enum OptionType {
+	OPTION_LONG,
+	OPTION_OFF_T,
+	OPTION_STRING,
+	OPTION_SLIST,
+};
+
+struct OptionInfo {
+	CURLoption option;
+	OptionType type;
+};
+
+bool operator<(const OptionInfo& a, const OptionInfo& b) {
+	return a.option < b.option;
+}
+
+OptionInfo optionTable[] = {
+	{ CURLOPT_ADDRESS_SCOPE, OPTION_LONG },
+	{ CURLOPT_APPEND, OPTION_LONG },
+	{ CURLOPT_AUTOREFERER, OPTION_LONG },
+	{ CURLOPT_BUFFERSIZE, OPTION_LONG },
+	{ CURLOPT_CERTINFO, OPTION_LONG },
+	{ CURLOPT_CLOSEPOLICY, OPTION_LONG },
+	{ CURLOPT_CONNECT_ONLY, OPTION_LONG },
+	{ CURLOPT_CONNECTTIMEOUT, OPTION_LONG },
+	{ CURLOPT_CONNECTTIMEOUT_MS, OPTION_LONG },
+	{ CURLOPT_COOKIESESSION, OPTION_LONG },
+	{ CURLOPT_CRLF, OPTION_LONG },
+	{ CURLOPT_DIRLISTONLY, OPTION_LONG },
+	{ CURLOPT_DNS_CACHE_TIMEOUT, OPTION_LONG },
+	{ CURLOPT_DNS_USE_GLOBAL_CACHE, OPTION_LONG },
+	{ CURLOPT_FAILONERROR, OPTION_LONG },
+	{ CURLOPT_FILETIME, OPTION_LONG },
+	{ CURLOPT_FOLLOWLOCATION, OPTION_LONG },
+	{ CURLOPT_FORBID_REUSE, OPTION_LONG },
+	{ CURLOPT_FRESH_CONNECT, OPTION_LONG },
+	{ CURLOPT_FTP_CREATE_MISSING_DIRS, OPTION_LONG },
+	{ CURLOPT_FTP_FILEMETHOD, OPTION_LONG },
+	{ CURLOPT_FTP_RESPONSE_TIMEOUT, OPTION_LONG },
+	{ CURLOPT_FTP_SKIP_PASV_IP, OPTION_LONG },
+	{ CURLOPT_FTPSSLAUTH, OPTION_LONG },
+	{ CURLOPT_FTP_SSL_CCC, OPTION_LONG },
+	{ CURLOPT_FTP_USE_EPRT, OPTION_LONG },
+	{ CURLOPT_FTP_USE_EPSV, OPTION_LONG },
+//	{ CURLOPT_FTP_USE_PRET, OPTION_LONG },
+	{ CURLOPT_HEADER, OPTION_LONG },
+	{ CURLOPT_HTTPAUTH, OPTION_LONG },
+	{ CURLOPT_HTTP_CONTENT_DECODING, OPTION_LONG },
+	{ CURLOPT_HTTPGET, OPTION_LONG },
+	{ CURLOPT_HTTPPROXYTUNNEL, OPTION_LONG },
+	{ CURLOPT_HTTP_TRANSFER_DECODING, OPTION_LONG },
+	{ CURLOPT_HTTP_VERSION, OPTION_LONG },
+#if LIBCURL_VERSION_NUM >= 0x072b00
+	{ CURLOPT_PIPEWAIT, OPTION_LONG },
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072e00
+	{ CURLOPT_STREAM_WEIGHT, OPTION_LONG },
+#endif
+	{ CURLOPT_IGNORE_CONTENT_LENGTH, OPTION_LONG },
+	{ CURLOPT_INFILESIZE, OPTION_LONG },
+	{ CURLOPT_IPRESOLVE, OPTION_LONG },
+	{ CURLOPT_LOCALPORT, OPTION_LONG },
+	{ CURLOPT_LOCALPORTRANGE, OPTION_LONG },
+	{ CURLOPT_LOW_SPEED_LIMIT, OPTION_LONG },
+	{ CURLOPT_LOW_SPEED_TIME, OPTION_LONG },
+	{ CURLOPT_MAXCONNECTS, OPTION_LONG },
+	{ CURLOPT_MAXFILESIZE, OPTION_LONG },
+	{ CURLOPT_MAXREDIRS, OPTION_LONG },
+	{ CURLOPT_NETRC, OPTION_LONG },
+	{ CURLOPT_NEW_DIRECTORY_PERMS, OPTION_LONG },
+	{ CURLOPT_NEW_FILE_PERMS, OPTION_LONG },
+	{ CURLOPT_NOBODY, OPTION_LONG },
+	{ CURLOPT_NOPROGRESS, OPTION_LONG },
+	{ CURLOPT_NOSIGNAL, OPTION_LONG },
+	{ CURLOPT_PORT, OPTION_LONG },
+	{ CURLOPT_POST, OPTION_LONG },
+	{ CURLOPT_POSTFIELDSIZE, OPTION_LONG },
+	{ CURLOPT_POSTREDIR, OPTION_LONG },
+	{ CURLOPT_PROTOCOLS, OPTION_LONG },
+	{ CURLOPT_PROXYAUTH, OPTION_LONG },
+	{ CURLOPT_PROXYPORT, OPTION_LONG },
+	{ CURLOPT_PROXY_TRANSFER_MODE, OPTION_LONG },
+	{ CURLOPT_PROXYTYPE, OPTION_LONG },
+	{ CURLOPT_PUT, OPTION_LONG },
+	{ CURLOPT_REDIR_PROTOCOLS, OPTION_LONG },
+	{ CURLOPT_RESUME_FROM, OPTION_LONG },
+//	{ CURLOPT_RTSP_CLIENT_CSEQ, OPTION_LONG },
+//	{ CURLOPT_RTSP_REQUEST, OPTION_LONG },
+//	{ CURLOPT_RTSP_SERVER_CSEQ, OPTION_LONG },
+	{ CURLOPT_SOCKS5_GSSAPI_NEC, OPTION_LONG },
+	{ CURLOPT_SSH_AUTH_TYPES, OPTION_LONG },
+	{ CURLOPT_SSLENGINE_DEFAULT, OPTION_LONG },
+	{ CURLOPT_SSL_SESSIONID_CACHE, OPTION_LONG },
+	{ CURLOPT_SSL_VERIFYHOST, OPTION_LONG },
+	{ CURLOPT_SSL_VERIFYPEER, OPTION_LONG },
+	{ CURLOPT_SSLVERSION, OPTION_LONG },
+	{ CURLOPT_TCP_NODELAY, OPTION_LONG },
+	{ CURLOPT_TFTP_BLKSIZE, OPTION_LONG },
+	{ CURLOPT_TIMECONDITION, OPTION_LONG },
+	{ CURLOPT_TIMEOUT, OPTION_LONG },
+	{ CURLOPT_TIMEOUT_MS, OPTION_LONG },
+	{ CURLOPT_TIMEVALUE, OPTION_LONG },
+#if LIBCURL_VERSION_NUM >= 0x071506
+	{ CURLOPT_TRANSFER_ENCODING, OPTION_LONG },
+#endif
+	{ CURLOPT_TRANSFERTEXT, OPTION_LONG },
+	{ CURLOPT_UNRESTRICTED_AUTH, OPTION_LONG },
+	{ CURLOPT_UPLOAD, OPTION_LONG },
+	{ CURLOPT_USE_SSL, OPTION_LONG },
+	{ CURLOPT_VERBOSE, OPTION_LONG },
+//	{ CURLOPT_WILDCARDMATCH, OPTION_LONG },
+
+	{ CURLOPT_INFILESIZE_LARGE, OPTION_OFF_T },
+	{ CURLOPT_MAXFILESIZE_LARGE, OPTION_OFF_T },
+	{ CURLOPT_MAX_RECV_SPEED_LARGE, OPTION_OFF_T },
+	{ CURLOPT_MAX_SEND_SPEED_LARGE, OPTION_OFF_T },
+	{ CURLOPT_POSTFIELDSIZE_LARGE, OPTION_OFF_T },
+	{ CURLOPT_RESUME_FROM_LARGE, OPTION_OFF_T },
+
+#if LIBCURL_VERSION_NUM >= 0x071506
+	{ CURLOPT_ACCEPT_ENCODING, OPTION_STRING },
+#else
+	{ CURLOPT_ENCODING, OPTION_STRING },
+#endif
+	{ CURLOPT_CAINFO, OPTION_STRING },
+	{ CURLOPT_CAPATH, OPTION_STRING },
+	{ CURLOPT_COOKIE, OPTION_STRING },
+	{ CURLOPT_COOKIEFILE, OPTION_STRING },
+	{ CURLOPT_COOKIEJAR, OPTION_STRING },
+	{ CURLOPT_COOKIELIST, OPTION_STRING },
+	{ CURLOPT_COPYPOSTFIELDS, OPTION_STRING },
+	{ CURLOPT_CRLFILE, OPTION_STRING },
+	{ CURLOPT_CUSTOMREQUEST, OPTION_STRING },
+	{ CURLOPT_EGDSOCKET, OPTION_STRING },
+	{ CURLOPT_FTP_ACCOUNT, OPTION_STRING },
+	{ CURLOPT_FTP_ALTERNATIVE_TO_USER, OPTION_STRING },
+	{ CURLOPT_FTPPORT, OPTION_STRING },
+	{ CURLOPT_INTERFACE, OPTION_STRING },
+	{ CURLOPT_ISSUERCERT, OPTION_STRING },
+	{ CURLOPT_KEYPASSWD, OPTION_STRING },
+	{ CURLOPT_KRBLEVEL, OPTION_STRING },
+	{ CURLOPT_NETRC_FILE, OPTION_STRING },
+	{ CURLOPT_NOPROXY, OPTION_STRING },
+	{ CURLOPT_PASSWORD, OPTION_STRING },
+	{ CURLOPT_PROXY, OPTION_STRING },
+	{ CURLOPT_PROXYPASSWORD, OPTION_STRING },
+	{ CURLOPT_PROXYUSERNAME, OPTION_STRING },
+	{ CURLOPT_PROXYUSERPWD, OPTION_STRING },
+	{ CURLOPT_RANDOM_FILE, OPTION_STRING },
+	{ CURLOPT_RANGE, OPTION_STRING },
+	{ CURLOPT_REFERER, OPTION_STRING },
+	{ CURLOPT_SOCKS5_GSSAPI_SERVICE, OPTION_STRING },
+	{ CURLOPT_SSH_HOST_PUBLIC_KEY_MD5, OPTION_STRING },
+	{ CURLOPT_SSH_KNOWNHOSTS, OPTION_STRING },
+	{ CURLOPT_SSH_PRIVATE_KEYFILE, OPTION_STRING },
+	{ CURLOPT_SSH_PUBLIC_KEYFILE, OPTION_STRING },
+	{ CURLOPT_SSLCERT, OPTION_STRING },
+	{ CURLOPT_SSLCERTTYPE, OPTION_STRING },
+	{ CURLOPT_SSL_CIPHER_LIST, OPTION_STRING },
+	{ CURLOPT_SSLENGINE, OPTION_STRING },
+	{ CURLOPT_SSLKEY, OPTION_STRING },
+	{ CURLOPT_SSLKEYTYPE, OPTION_STRING },
+	{ CURLOPT_URL, OPTION_STRING },
+	{ CURLOPT_USERAGENT, OPTION_STRING },
+	{ CURLOPT_USERNAME, OPTION_STRING },
+	{ CURLOPT_USERPWD, OPTION_STRING },
+
+	{ CURLOPT_HTTP200ALIASES, OPTION_SLIST },
+	{ CURLOPT_HTTPHEADER, OPTION_SLIST },
+	{ CURLOPT_POSTQUOTE, OPTION_SLIST },
+	{ CURLOPT_PREQUOTE, OPTION_SLIST },
+	{ CURLOPT_QUOTE, OPTION_SLIST },
+	{ CURLOPT_TELNETOPTIONS, OPTION_SLIST },
+#if LIBCURL_VERSION_NUM >= 0x071503
+	{ CURLOPT_RESOLVE, OPTION_SLIST },
+#endif
+#if LIBCURL_VERSION_NUM >= 0x073100
+	{ CURLOPT_CONNECT_TO, OPTION_SLIST },
+#endif
+};
+
+OptionInfo* const optionTableEnd = optionTable + sizeof(optionTable) / sizeof(optionTable[0]);
+
+void SortOptionTable() {
+	std::sort(optionTable, optionTableEnd);
+}
+
+const OptionInfo* FindOption(CURLoption option) {
+	const OptionInfo key = { option, OPTION_LONG };
+	const OptionInfo* info = std::lower_bound(optionTable, optionTableEnd, key);
+	return info != optionTableEnd && info->option == option ? info : NULL;
+}
+
+//
+// bindings (glue)
+//
+Handle<Value> curl_easy_init_g(const Arguments& /*args*/) {
+	return EasyHandle::New();
+}
+
+Handle<Value> SetTableOption(EasyHandle* ch, const OptionInfo& info, Handle<Value> value) {
+	const CURLoption option = info.option;
+	CURLcode status = CURLE_OK;
+
+	switch (info.type) {
+	case OPTION_LONG:
+		if (value->IsInt32()) { // special-case booleans? think CURLOPT_VERBOSE
+			const long val = value->Int32Value();
+			status = curl_easy_setopt(*ch, option, val);
+		}
+		else {
+			return TypeError("Argument #3 must be an integer.");
+		}
+		break;
+
+	case OPTION_OFF_T:
+		if (value->IsNumber()) {
+			const curl_off_t val = static_cast<curl_off_t>(value->NumberValue());
+			status = curl_easy_setopt(*ch, option, val);
+		}
+		else {
+			return TypeError("Argument #3 must be a number.");
+		}
+		break;
+
+	case OPTION_STRING:
+		// libcurl makes a copy of the string
+		if (value->IsString()) {
+			const char* s = ch->ToUtf8(value);
+			status = curl_easy_setopt(*ch, option, s);
+			if (option == CURLOPT_URL) {
+				ch->SetHost(s);
+			}
+		}
+		else if (value->IsNull()) {
+			status = curl_easy_setopt(*ch, option, static_cast<char*>(NULL));
+		}
+		else {
+			return TypeError("Argument #3 must be a string or null.");
+		}
+		break;
+
+	case OPTION_SLIST:
+		// but not of a list, the handle keeps it alive
+		if (value->IsArray()) {
+			curl_slist* slist = ch->NewSList(option, Handle<Array>::Cast(value));
+			if (slist == NULL && Handle<Array>::Cast(value)->Length() > 0) {
+				return Error("Out of memory.");
+			}
+			status = curl_easy_setopt(*ch, option, slist);
+			ch->SetSList(option, slist);
+		}
+		else if (value->IsNull()) {
+			status = curl_easy_setopt(*ch, option, static_cast<curl_slist*>(NULL));
+			ch->SetSList(option, NULL);
+		}
+		else {
+			return TypeError("Argument #3 must be an array or null.");
+		}
+		break;
+	}
+
+	if (status != CURLE_OK) {
+		return CurlError(status);
+	}
+
+	return Undefined();
+}
+
+Handle<Value> SetOption(EasyHandle* ch, CURLoption option, Handle<Value> value) {
+	const OptionInfo* info = FindOption(option);
+	if (info != NULL) {
+		return SetTableOption(ch, *info, value);
+	}
+
+	CURLcode status = CURLE_OK;
+
+	switch (static_cast<int>(option)) {
+	case CURLOPT_POSTFIELDS:
+		// libcurl doesn't copy the post data, the handle does
+		if (Buffer::HasInstance(value)) {
+			Local<Object> buffer = value->ToObject();
+			status = ch->SetPostFields(Buffer::Data(buffer), Buffer::Length(buffer));
+		}
+		else if (value->IsString()) {
+			size_t length;
+			const char* s = ch->ToUtf8(value, &length);
+			status = ch->SetPostFields(s, length);
+		}
+		else {
+			return TypeError("Argument #3 must be a string or a buffer.");
+		}
+		break;
+
+	case CURLOPT_WRITEFUNCTION:
+		if (value->IsFunction()) {
+			ch->SetWriteCallback(value);
+			curl_easy_setopt(*ch, CURLOPT_WRITEFUNCTION, WriteFunction);
+			curl_easy_setopt(*ch, CURLOPT_WRITEDATA, ch);
+		}
+		else {
+			return TypeError("Argument #3 must be a function.");
+		}
+		break;
+
+	case CURLOPT_READFUNCTION:
+		if (value->IsFunction()) {
+			ch->SetReadCallback(value);
+			curl_easy_setopt(*ch, CURLOPT_READFUNCTION, ReadFunction);
+			curl_easy_setopt(*ch, CURLOPT_READDATA, ch);
+		}
+		else {
+			return TypeError("Argument #3 must be a function.");
+		}
+		break;
+
+	case NODECURLOPT_UPLOADSTREAM:
+		if (value->IsInt32()) {
+			const bool upload_stream = value->Int32Value() != 0;
+			ch->SetUploadStream(upload_stream);
+			if (upload_stream) {
+				curl_easy_setopt(*ch, CURLOPT_READFUNCTION, ReadFunction);
+				curl_easy_setopt(*ch, CURLOPT_READDATA, ch);
+			}
+		}
+		else {
+			return TypeError("Argument #3 must be an integer.");
+		}
+		break;
+
+	case NODECURLOPT_WRITEBUFFER:
+		if (Buffer::HasInstance(value)) {
+			ch->SetWriteBuffer(value->ToObject());
+		}
+		else if (value->IsInt32() && value->Int32Value() > 0) {
+			ch->SetWriteBuffer(Buffer::New(value->Int32Value())->handle_);
+		}
+		else {
+			return TypeError("Argument #3 must be a buffer or a positive integer.");
+		}
+		break;
+
+#if LIBCURL_VERSION_NUM >= 0x072e00
+	// the other handle has to be on the same multi handle, a worker pool
+	// won't take handles with a dependency
+	case CURLOPT_STREAM_DEPENDS:
+	case CURLOPT_STREAM_DEPENDS_E:
+		if (EasyHandle::IsInstanceOf(value) && EasyHandle::Unwrap(value) != ch) {
+			status = curl_easy_setopt(*ch, option, static_cast<CURL*>(*EasyHandle::Unwrap(value)));
+			if (status == CURLE_OK) {
+				ch->SetStreamDepends(value->ToObject());
+			}
+		}
+		else if (value->IsNull()) {
+			status = curl_easy_setopt(*ch, option, static_cast<CURL*>(NULL));
+			if (status == CURLE_OK) {
+				ch->SetStreamDepends(Handle<Object>());
+			}
+		}
+		else {
+			return TypeError("Argument #3 must be another node-curl handle or null.");
+		}
+		break;
+#endif
+
+	case CURLOPT_SHARE:
+		if (ShareHandle::IsInstanceOf(value)) {
+			ShareHandle* sh = ShareHandle::Unwrap(value);
+			status = curl_easy_setopt(*ch, option, static_cast<CURLSH*>(*sh));
+			if (status == CURLE_OK) {
+				ch->SetShare(value->ToObject());
+			}
+		}
+		else if (value->IsNull()) {
+			status = curl_easy_setopt(*ch, option, static_cast<CURLSH*>(NULL));
+			if (status == CURLE_OK) {
+				ch->SetShare(Handle<Object>());
+			}
+		}
+		else {
+			return TypeError("Argument #3 must be a node-curl share handle or null.");
+		}
+		break;
+
+	case NODECURLOPT_ACCUMULATE:
+		if (value->IsInt32()) {
+			const bool accumulate = value->Int32Value() != 0;
+			ch->SetAccumulate(accumulate);
+			if (accumulate) {
+				curl_easy_setopt(*ch, CURLOPT_WRITEFUNCTION, BodyFunction);
+				curl_easy_setopt(*ch, CURLOPT_WRITEDATA, ch);
+			}
+		}
+		else {
+			return TypeError("Argument #3 must be an integer.");
+		}
+		break;
+
+	case NODECURLOPT_WRITEFILE:
+		if (value->IsString()) {
+			ch->SetWriteFile(ch->ToUtf8(value));
+		}
+		else if (value->IsInt32() && value->Int32Value() >= 0) {
+			ch->SetWriteFile(value->Int32Value());
+		}
+		else if (value->IsNull()) {
+			ch->SetWriteFile(-1);
+			break;
+		}
+		else {
+			return TypeError("Argument #3 must be a path, a file descriptor or null.");
+		}
+		curl_easy_setopt(*ch, CURLOPT_WRITEFUNCTION, BodyFunction);
+		curl_easy_setopt(*ch, CURLOPT_WRITEDATA, ch);
+		break;
+
+	case NODECURLOPT_HEADERS:
+		ch->SetCaptureHeaders(value->BooleanValue());
+		if (value->BooleanValue()) {
+			curl_easy_setopt(*ch, CURLOPT_HEADERFUNCTION, HeaderFunction);
+			curl_easy_setopt(*ch, CURLOPT_HEADERDATA, ch);
+		}
+		else {
+			curl_easy_setopt(*ch, CURLOPT_HEADERFUNCTION, NULL);
+			curl_easy_setopt(*ch, CURLOPT_HEADERDATA, NULL);
+		}
+		break;
+
+	case NODECURLOPT_PRIORITY:
+		if (value->IsInt32() && value->Int32Value() >= 0 && value->Int32Value() < PRIORITY_LEVELS) {
+			ch->SetPriority(value->Int32Value());
+		}
+		else {
+			return TypeError("Argument #3 must be a priority level.");
+		}
+		break;
+
+	case NODECURLOPT_AUTOCLOSE:
+		ch->SetAutoClose(value->BooleanValue());
+		break;
+
+	case NODECURLOPT_PROGRESS:
+		ch->SetProgress(value->BooleanValue());
+		if (value->BooleanValue()) {
+#if LIBCURL_VERSION_NUM >= 0x072000
+			curl_easy_setopt(*ch, CURLOPT_XFERINFOFUNCTION, XferInfoFunction);
+			curl_easy_setopt(*ch, CURLOPT_XFERINFODATA, ch);
+#else
+			curl_easy_setopt(*ch, CURLOPT_PROGRESSFUNCTION, ProgressFunction);
+			curl_easy_setopt(*ch, CURLOPT_PROGRESSDATA, ch);
+#endif
+			curl_easy_setopt(*ch, CURLOPT_NOPROGRESS, 0L);
+		}
+		else {
+			curl_easy_setopt(*ch, CURLOPT_NOPROGRESS, 1L);
+		}
+		break;
+
+	case NODECURLOPT_DNS_CACHE:
+		ch->SetUseDnsCache(value->BooleanValue());
+		break;
+
+	case NODECURLOPT_WRITEFILE_OFFSET:
+		if (value->IsNumber() && value->NumberValue() >= 0) {
+			ch->SetWriteFileOffset(static_cast<curl_off_t>(value->NumberValue()));
+		}
+		else {
+			return TypeError("Argument #3 must be a non-negative number.");
+		}
+		break;
+
+	case NODECURLOPT_WRITE_HIGHWATERMARK:
+		if (value->IsInt32() && value->Int32Value() >= 0) {
+			ch->SetWriteHighWaterMark(value->Int32Value());
+		}
+		else {
+			return TypeError("Argument #3 must be a non-negative integer.");
+		}
+		break;
+
+	case NODECURLOPT_WRITE_MAXDELAY:
+		if (value->IsInt32() && value->Int32Value() >= 0) {
+			ch->SetWriteMaxDelay(value->Int32Value());
+		}
+		else {
+			return TypeError("Argument #3 must be a non-negative integer.");
+		}
+		break;
+
+	default:
+		return TypeError("Argument #3 must be a CURLOPT_* constant.");
+	}
+
+	if (status != CURLE_OK) {
+		// TODO throw a {code, message} exception
+		return CurlError(status);
+	}
+
+	return Undefined();
+}
+
+Handle<Value> curl_easy_setopt_g(const Arguments& args) {
+	if (!EasyHandle::IsInstanceOf(args[0])) {
+		return TypeError("Argument #1 must be a node-curl handle.");
+	}
+	EasyHandle* ch = EasyHandle::Unwrap(args[0]);
+
+	if (ch->IsOffThread()) {
+		return Error("Cannot set options on a handle running on a worker pool.");
+	}
+
+	if (!args[1]->IsInt32()) {
+		return TypeError("Argument #2 must be a CURL_* constant.");
+	}
+	const CURLoption option = (CURLoption) args[1]->Int32Value();
+
+	return SetOption(ch, option, args[2]);
+}
+
+// sets several options in one call, the options are passed as a flat
+// [option, value, option, value, ...] array; stops at the first bad option
+Handle<Value> curl_easy_setopt_array_g(const Arguments& args) {
+	if (!EasyHandle::IsInstanceOf(args[0])) {
+		return TypeError("Argument #1 must be a node-curl handle.");
+	}
+	EasyHandle* ch = EasyHandle::Unwrap(args[0]);
+
+	if (ch->IsOffThread()) {
+		return Error("Cannot set options on a handle running on a worker pool.");
+	}
+
+	if (!args[1]->IsArray()) {
+		return TypeError("Argument #2 must be an array.");
+	}
+	Local<Array> array = Local<Array>::Cast(args[1]);
+
+	if (array->Length() % 2 != 0) {
+		return TypeError("Argument #2 must hold option/value pairs.");
+	}
+
+	// checked up front, an exception thrown while tc is active would be lost
+	for (uint32_t i = 0; i < array->Length(); i += 2) {
+		if (!array->Get(i)->IsInt32()) {
+			return TypeError("Argument #2 must hold CURLOPT_* constants.");
+		}
+	}
+
+	TryCatch tc;
+
+	for (uint32_t i = 0; i < array->Length(); i += 2) {
+		SetOption(ch, (CURLoption) array->Get(i)->Int32Value(), array->Get(i + 1));
+		if (tc.HasCaught()) {
+			return tc.ReThrow();
+		}
+	}
+
+	return Undefined();
 }
 
-int curl2ev(int events) {
-	if (events == CURL_POLL_IN) {
-		return EV_READ;
+unsigned SListSize(const curl_slist* slist) {
+	unsigned entries = 0;
+
+	for (; slist != NULL; ++entries, slist = slist->next);
+
+	return entries;
+}
+
+Handle<Array> SListToArray(const curl_slist* slist) {
+	Local<Array> array = Array::New(SListSize(slist));
+
+	for (unsigned i = 0; slist != NULL; ++i, slist = slist->next) {
+		array->Set(i, String::New(slist->data));
 	}
-	if (events == CURL_POLL_OUT) {
-		return EV_WRITE;
+
+	return array;
+}
+
+Handle<Array> CertInfoToArray(const struct curl_certinfo* certinfo) {
+	Local<Array> array = Array::New(certinfo->num_of_certs);
+
+	for (int i = 0; i < certinfo->num_of_certs; ++i) {
+		array->Set(i, SListToArray(certinfo->certinfo[i]));
 	}
-	if (events == CURL_POLL_INOUT) {
-		return EV_READ | EV_WRITE;
+
+	return array;
+}
+
+Handle<Value> curl_easy_getinfo_g(const Arguments& args) {
+	if (!EasyHandle::IsInstanceOf(args[0])) {
+		return TypeError("Argument #1 must be a node-curl handle.");
 	}
-	return 0;
+	EasyHandle* ch = EasyHandle::Unwrap(args[0]);
+
+	if (ch->IsOffThread()) {
+		return Error("Cannot get info from a handle running on a worker pool.");
+	}
+
+	if (!args[1]->IsInt32()) {
+		return TypeError("Argument #2 must be a CURLINFO_* constant.");
+	}
+	const CURLINFO option = (CURLINFO) args[1]->Int32Value();
+
+	union {
+		const struct curl_certinfo* certinfo_;
+		const curl_slist* slist_;
+		const char* string_;
+		double double_;
+		long long_;
+	} value;
+
+	CURLcode status = curl_easy_getinfo(*ch, option, &value);
+	if (status != CURLE_OK) {
+		return CurlError(status);
+	}
+
+	Handle<Value> rv;
+
+	switch (option) {
+	case CURLINFO_CONDITION_UNMET:
+	case CURLINFO_FILETIME:
+	case CURLINFO_HEADER_SIZE:
+	case CURLINFO_HTTPAUTH_AVAIL:
+	case CURLINFO_HTTP_CONNECTCODE:
+	case CURLINFO_LASTSOCKET:
+//	case CURLINFO_LOCAL_PORT:
+	case CURLINFO_NUM_CONNECTS:
+	case CURLINFO_OS_ERRNO:
+//	case CURLINFO_PRIMARY_PORT:
+	case CURLINFO_PROXYAUTH_AVAIL:
+	case CURLINFO_REDIRECT_COUNT:
+	case CURLINFO_REQUEST_SIZE:
+	case CURLINFO_RESPONSE_CODE:
+//	case CURLINFO_RTSP_CLIENT_CSEQ:
+//	case CURLINFO_RTSP_CSEQ_RECV:
+//	case CURLINFO_RTSP_SERVER_CSEQ:
+	case CURLINFO_SSL_VERIFYRESULT:
+		rv = Integer::New(value.long_);
+		break;
+
+	case CURLINFO_APPCONNECT_TIME:
+	case CURLINFO_CONNECT_TIME:
+	case CURLINFO_CONTENT_LENGTH_DOWNLOAD:
+	case CURLINFO_CONTENT_LENGTH_UPLOAD:
+	case CURLINFO_NAMELOOKUP_TIME:
+	case CURLINFO_PRETRANSFER_TIME:
+	case CURLINFO_REDIRECT_TIME:
+	case CURLINFO_SIZE_DOWNLOAD:
+	case CURLINFO_SIZE_UPLOAD:
+	case CURLINFO_SPEED_DOWNLOAD:
+	case CURLINFO_SPEED_UPLOAD:
+	case CURLINFO_STARTTRANSFER_TIME:
+	case CURLINFO_TOTAL_TIME:
+		rv = Number::New(value.double_);
+		break;
+
+	case CURLINFO_CONTENT_TYPE:
+	case CURLINFO_EFFECTIVE_URL:
+	case CURLINFO_FTP_ENTRY_PATH:
+//	case CURLINFO_LOCAL_IP:
+	case CURLINFO_PRIMARY_IP:
+	case CURLINFO_REDIRECT_URL:
+//	case CURLINFO_RTSP_SESSION_ID:
+		if (value.string_) {
+			rv = String::New(value.string_);
+		}
+		else {
+			rv = String::Empty();
+		}
+		break;
+
+	case CURLINFO_COOKIELIST:
+	case CURLINFO_SSL_ENGINES:
+		rv = SListToArray(value.slist_);
+		break;
+
+	case CURLINFO_CERTINFO:
+		rv = CertInfoToArray(value.certinfo_);
+		break;
+
+	default:
+		return TypeError("Argument #2 must be a CURLINFO_* constant.");
+	}
+
+	return rv;
 }
 
-int MultiHandle::SocketFunction(
-	CURLM* /*handle*/, curl_socket_t sockfd, int events, void* userp, void* /*socketp*/)
-{
-	MultiHandle& self = *reinterpret_cast<MultiHandle*>(userp);
+// indexes into the array curl_easy_getmetrics() fills
+enum Metric {
+	CURLMETRIC_NAMELOOKUP_TIME,
+	CURLMETRIC_CONNECT_TIME,
+	CURLMETRIC_APPCONNECT_TIME,
+	CURLMETRIC_PRETRANSFER_TIME,
+	CURLMETRIC_STARTTRANSFER_TIME,
+	CURLMETRIC_TOTAL_TIME,
+	CURLMETRIC_REDIRECT_TIME,
+	CURLMETRIC_REDIRECT_COUNT,
+	CURLMETRIC_RESPONSE_CODE,
+	CURLMETRIC_HEADER_SIZE,
+	CURLMETRIC_REQUEST_SIZE,
+	CURLMETRIC_SIZE_UPLOAD,
+	CURLMETRIC_SIZE_DOWNLOAD,
+	CURLMETRIC_SPEED_UPLOAD,
+	CURLMETRIC_SPEED_DOWNLOAD,
+	CURLMETRIC_CONTENT_LENGTH_DOWNLOAD,
+	CURLMETRIC_COUNT,
+};
+
+// same order as Metric
+const CURLINFO metricInfo[CURLMETRIC_COUNT] = {
+	CURLINFO_NAMELOOKUP_TIME,
+	CURLINFO_CONNECT_TIME,
+	CURLINFO_APPCONNECT_TIME,
+	CURLINFO_PRETRANSFER_TIME,
+	CURLINFO_STARTTRANSFER_TIME,
+	CURLINFO_TOTAL_TIME,
+	CURLINFO_REDIRECT_TIME,
+	CURLINFO_REDIRECT_COUNT,
+	CURLINFO_RESPONSE_CODE,
+	CURLINFO_HEADER_SIZE,
+	CURLINFO_REQUEST_SIZE,
+	CURLINFO_SIZE_UPLOAD,
+	CURLINFO_SIZE_DOWNLOAD,
+	CURLINFO_SPEED_UPLOAD,
+	CURLINFO_SPEED_DOWNLOAD,
+	CURLINFO_CONTENT_LENGTH_DOWNLOAD,
+};
+
+// timings and sizes of the last transfer in one go, indexed by CURLMETRIC_*;
+// they're written straight into the memory of a Float64Array (or anything
+// else backed by an external double array) when one is passed in, that can
+// be reused across transfers; a plain array is filled or created otherwise
+Handle<Value> curl_easy_getmetrics_g(const Arguments& args) {
+	if (!EasyHandle::IsInstanceOf(args[0])) {
+		return TypeError("Argument #1 must be a node-curl handle.");
+	}
+	EasyHandle* ch = EasyHandle::Unwrap(args[0]);
+
+	if (ch->IsOffThread()) {
+		return Error("Cannot get metrics from a handle running on a worker pool.");
+	}
+
+	if (!args[1]->IsUndefined() && !args[1]->IsObject()) {
+		return TypeError("Argument #2 must be an array or undefined.");
+	}
+
+	double metrics[CURLMETRIC_COUNT];
+
+	for (int i = 0; i < CURLMETRIC_COUNT; ++i) {
+		const CURLINFO info = metricInfo[i];
+
+		if ((info & CURLINFO_TYPEMASK) == CURLINFO_LONG) {
+			long value = 0;
+			curl_easy_getinfo(*ch, info, &value);
+			metrics[i] = value;
+		}
+		else {
+			double value = 0;
+			curl_easy_getinfo(*ch, info, &value);
+			metrics[i] = value;
+		}
+	}
+
+	Local<Object> target = args[1]->IsObject() ? args[1]->ToObject() : Local<Object>(Array::New(CURLMETRIC_COUNT));
+
+	if (target->HasIndexedPropertiesInExternalArrayData()
+			&& target->GetIndexedPropertiesExternalArrayDataType() == kExternalDoubleArray) {
+		if (target->GetIndexedPropertiesExternalArrayDataLength() < CURLMETRIC_COUNT) {
+			return TypeError("Argument #2 is too short.");
+		}
+		memcpy(target->GetIndexedPropertiesExternalArrayData(), metrics, sizeof(metrics));
+	}
+	else {
+		for (int i = 0; i < CURLMETRIC_COUNT; ++i) {
+			target->Set(i, Number::New(metrics[i]));
+		}
+	}
+
+	return target;
+}
+
+// queues a Buffer for a streaming upload, null marks the end of the data;
+// returns the number of bytes that are queued and not yet sent
+Handle<Value> curl_easy_upload_g(const Arguments& args) {
+	if (!EasyHandle::IsInstanceOf(args[0])) {
+		return TypeError("Argument #1 must be a node-curl handle.");
+	}
+	EasyHandle* ch = EasyHandle::Unwrap(args[0]);
+
+	if (!Buffer::HasInstance(args[1]) && !args[1]->IsNull()) {
+		return TypeError("Argument #2 must be a buffer or null.");
+	}
+	if (!ch->IsUploadStream()) {
+		return Error("The handle isn't in upload stream mode, set NODECURLOPT_UPLOADSTREAM or CURLOPT_READFUNCTION.");
+	}
+
+	return Number::New(ch->QueueUpload(args[1]));
+}
+
+Handle<Value> curl_easy_pause_g(const Arguments& args) {
+	if (!EasyHandle::IsInstanceOf(args[0])) {
+		return TypeError("Argument #1 must be a node-curl handle.");
+	}
+	EasyHandle* ch = EasyHandle::Unwrap(args[0]);
+
+	if (!args[1]->IsInt32()) {
+		return TypeError("Argument #2 must be a CURLPAUSE_* constant.");
+	}
+	if (ch->IsOffThread()) {
+		return Error("Handles on a worker pool can't be paused.");
+	}
+
+	CURLcode status = ch->Pause(args[1]->Int32Value());
+	if (status != CURLE_OK) {
+		return CurlError(status);
+	}
+
+	return Undefined();
+}
+
+Handle<Value> curl_easy_reset_g(const Arguments& args) {
+	if (!EasyHandle::IsInstanceOf(args[0])) {
+		return TypeError("Argument #1 must be a node-curl handle.");
+	}
+	EasyHandle* ch = EasyHandle::Unwrap(args[0]);
+
+	if (ch->IsInFlight()) {
+		return Error("Cannot reset a handle while its transfer is in progress.");
+	}
+	if (ch->HasDependents()) {
+		return Error("Cannot reset a handle other handles' streams depend on.");
+	}
+	ch->Reset();
+
+	return Undefined();
+}
+
+// frees the handle's resources now rather than when it's garbage collected
+Handle<Value> curl_easy_cleanup_g(const Arguments& args) {
+	if (!EasyHandle::IsInstanceOf(args[0])) {
+		return TypeError("Argument #1 must be a node-curl handle.");
+	}
+	EasyHandle* ch = EasyHandle::Unwrap(args[0]);
+
+	if (ch->IsInFlight()) {
+		return Error("Cannot close a handle while its transfer is in progress.");
+	}
+	if (ch->HasDependents()) {
+		return Error("Cannot close a handle other handles' streams depend on.");
+	}
+	ch->Close();
+
+	return Undefined();
+}
+
+Handle<Value> curl_easy_setpoolsize_g(const Arguments& args) {
+	if (!args[0]->IsInt32() || args[0]->Int32Value() < 0) {
+		return TypeError("Argument #1 must be a non-negative integer.");
+	}
+	EasyHandle::SetPoolSize(args[0]->Int32Value());
+
+	return Undefined();
+}
+
+Handle<Value> curl_multi_init_g(const Arguments& /*args*/) {
+	return MultiHandle::New();
+}
+
+Handle<Value> curl_multi_setopt_g(const Arguments& args) {
+	if (!MultiHandle::IsInstanceOf(args[0])) {
+		return TypeError("Argument #1 must be a node-curl multi handle.");
+	}
+	MultiHandle* mh = MultiHandle::Unwrap(args[0]);
+
+	if (!args[1]->IsInt32()) {
+		return TypeError("Argument #2 must be a CURLMOPT_* constant.");
+	}
+	const CURLMoption option = (CURLMoption) args[1]->Int32Value();
+
+	CURLMcode status = CURLM_OK;
+
+	switch (static_cast<int>(option)) {
+	case NODECURLMOPT_MAX_INFLIGHT:
+		if (args[2]->IsInt32() && args[2]->Int32Value() >= 0) {
+			mh->SetMaxInFlight(args[2]->Int32Value());
+		}
+		else {
+			return TypeError("Argument #3 must be a non-negative integer.");
+		}
+		break;
+
+	case NODECURLMOPT_MAX_HOST_INFLIGHT:
+		if (args[2]->IsInt32() && args[2]->Int32Value() >= 0) {
+			mh->SetMaxHostInFlight(args[2]->Int32Value());
+		}
+		else {
+			return TypeError("Argument #3 must be a non-negative integer.");
+		}
+		break;
 
-	fprintf(stderr, "%s: sockfd=%d, events=%d\n", __func__, sockfd, events);
+	case NODECURLMOPT_HOST_RATE:
+		if (args[2]->IsNumber() && args[2]->NumberValue() >= 0) {
+			mh->SetHostRate(args[2]->NumberValue());
+		}
+		else {
+			return TypeError("Argument #3 must be a non-negative number.");
+		}
+		break;
 
-	// translate curl flags to libev flags
-	events = curl2ev(events);
+	case NODECURLMOPT_HOST_BURST:
+		if (args[2]->IsNumber() && args[2]->NumberValue() >= 0) {
+			mh->SetHostBurst(args[2]->NumberValue());
+		}
+		else {
+			return TypeError("Argument #3 must be a non-negative number.");
+		}
+		break;
 
-	SockFDs::iterator it = self.sockfds_.find(sockfd);
-	if (it == self.sockfds_.end()) {
-		if (events) {
-			// create I/O watcher and add it to the list
-			ev_io& w = self.sockfds_.insert(SockFDs::value_type(sockfd, ev_io())).first->second;
-			ev_io_init(&w, IOEventFunction, sockfd, events);
-			ev_io_start(&w);
-			w.data = reinterpret_cast<void*>(&self);
+	case NODECURLMOPT_PRIORITY_WEIGHTS:
+		if (args[2]->IsArray() && Handle<Array>::Cast(args[2])->Length() == PRIORITY_LEVELS) {
+			Handle<Array> array = Handle<Array>::Cast(args[2]);
+			unsigned weights[PRIORITY_LEVELS];
+			for (int i = 0; i < PRIORITY_LEVELS; ++i) {
+				Local<Value> weight = array->Get(i);
+				if (!weight->IsInt32() || weight->Int32Value() < 1) {
+					return TypeError("Argument #3 must be an array of positive integers, one per priority level.");
+				}
+				weights[i] = weight->Int32Value();
+			}
+			mh->SetPriorityWeights(weights);
 		}
 		else {
-			assert(0 && "CURL_POLL_NONE or CURL_POLL_REMOVE for bad socket");
+			return TypeError("Argument #3 must be an array of positive integers, one per priority level.");
 		}
-	}
-	else {
-		ev_io& w = it->second;
-		if (events) {
-			// update the event flags
-			ev_io_set(&w, sockfd, events);
+		break;
+
+	case CURLMOPT_MAXCONNECTS:
+	case CURLMOPT_PIPELINING:
+#if LIBCURL_VERSION_NUM >= 0x071e00
+	case CURLMOPT_MAX_HOST_CONNECTIONS:
+	case CURLMOPT_MAX_TOTAL_CONNECTIONS:
+#endif
+		if (args[2]->IsInt32()) {
+			const long val = args[2]->Int32Value();
+			status = curl_multi_setopt(*mh, option, val);
 		}
 		else {
-			// disarm and dispose fd watcher
-			ev_io_stop(&w);
-			self.sockfds_.erase(it);
+			return TypeError("Argument #3 must be an integer.");
 		}
+		break;
+
+	default:
+		return TypeError("Argument #2 must be a CURLMOPT_* constant.");
 	}
 
-	return CURLM_OK;
+	if (status != CURLM_OK) {
+		return CurlError(status);
+	}
+
+	return Undefined();
 }
 
-void MultiHandle::IOEventFunction(ev_io* w, int events) {
-	MultiHandle& self = *reinterpret_cast<MultiHandle*>(w->data);
+// curl_multi_stats([multi[, clear]]), the default multi handle if none is given
+Handle<Value> curl_multi_stats_g(const Arguments& args) {
+	MultiHandle* mh = &MultiHandle::Singleton();
+	if (MultiHandle::IsInstanceOf(args[0])) {
+		mh = MultiHandle::Unwrap(args[0]);
+	}
+	else if (!args[0]->IsUndefined()) {
+		return TypeError("Argument #1 must be a node-curl multi handle.");
+	}
 
-	fprintf(stderr, "%s: sockfd=%d, events=%d\n", __func__, w->fd, events);
-	self.ProcessEvents();
+	return mh->Stats(args[1]->BooleanValue());
 }
 
-Handle<Value> MultiHandle::Add(EasyHandle& ch) {
-	CURLMcode status = curl_multi_add_handle(mh_, ch);
-	if (status != CURLM_OK) {
-		return CurlError(status);
+// what the libcurl we run against can do, `features` is a mask of the
+// CURL_VERSION_* bits; CURL_VERSION_LIBZ (and _BROTLI, _ZSTD) tell which
+// content encodings CURLOPT_ACCEPT_ENCODING = "" asks for and decodes
+Handle<Value> StringOrNull(const char* s) {
+	if (s != NULL) {
+		return String::New(s);
 	}
+	else {
+		return Null();
+	}
+}
 
-	if (++num_handles_ == 1) {
-		ev_ref();
+Handle<Value> curl_version_info_g(const Arguments& /*args*/) {
+	const curl_version_info_data* info = curl_version_info(CURLVERSION_NOW);
+
+	Local<Object> o = Object::New();
+	o->Set(String::NewSymbol("version"), String::New(info->version));
+	o->Set(String::NewSymbol("features"), Integer::New(info->features));
+	o->Set(String::NewSymbol("ssl_version"), StringOrNull(info->ssl_version));
+	o->Set(String::NewSymbol("libz_version"), StringOrNull(info->libz_version));
+#if LIBCURL_VERSION_NUM >= 0x073900
+	if (info->age >= CURLVERSION_FIFTH) {
+		o->Set(String::NewSymbol("brotli_version"), StringOrNull(info->brotli_version));
+	}
+#endif
+
+	return o;
+}
+
+// curl_progress_init(callback[, interval_ms]), see Progress; the interval
+// defaults to 250 ms
+Handle<Value> curl_progress_init_g(const Arguments& args) {
+	if (!args[0]->IsFunction() && !args[0]->IsNull()) {
+		return TypeError("Argument #1 must be a function or null.");
+	}
+
+	double interval = 250;
+	if (args[1]->IsNumber() && args[1]->NumberValue() > 0) {
+		interval = args[1]->NumberValue();
+	}
+	else if (!args[1]->IsUndefined()) {
+		return TypeError("Argument #2 must be a positive number.");
 	}
 
-	ProcessEvents();
+	Progress::SetCallback(args[0], interval / 1000.);
 
 	return Undefined();
 }
 
-//
-// helpers
-//
-size_t WriteFunction(char* data, size_t size, size_t nmemb, void* arg) {
-	EasyHandle* ch = reinterpret_cast<EasyHandle*>(arg);
+// curl_dns_prefetch(["host:port", ...]) resolves the hosts in the background
+// so the first transfer to each of them doesn't wait for the resolver
+Handle<Value> curl_dns_prefetch_g(const Arguments& args) {
+	if (!args[0]->IsArray()) {
+		return TypeError("Argument #1 must be an array of \"host:port\" strings.");
+	}
+	Handle<Array> array = Handle<Array>::Cast(args[0]);
 
-	TryCatch tc;
+	for (uint32_t i = 0; i < array->Length(); ++i) {
+		String::Utf8Value host_port(array->Get(i));
+		DnsCache::Prefetch(*host_port);
+	}
 
-	ch->InvokeWriteCallback(Buffer::New(data, size * nmemb));
+	return Undefined();
+}
 
-	if (tc.HasCaught()) {
-		FatalException(tc);
-		return 0;
+// how long resolved addresses are used (in seconds), they're refreshed a bit
+// before that
+Handle<Value> curl_dns_setttl_g(const Arguments& args) {
+	if (!args[0]->IsNumber() || args[0]->NumberValue() <= 0) {
+		return TypeError("Argument #1 must be a positive number.");
 	}
+	DnsCache::SetTTL(args[0]->NumberValue());
 
-	return nmemb;
+	return Undefined();
 }
 
-//
-// bindings (glue)
-//
-Handle<Value> curl_easy_init_g(const Arguments& /*args*/) {
-	return EasyHandle::New();
+Handle<Value> curl_workers_init_g(const Arguments& args) {
+	if (!args[0]->IsInt32() || args[0]->Int32Value() <= 0) {
+		return TypeError("Argument #1 must be a positive integer.");
+	}
+	return WorkerPool::New(args[0]->Int32Value());
 }
 
-Handle<Value> curl_easy_setopt_g(const Arguments& args) {
-	CURLcode status = CURLE_OK;
+Handle<Value> curl_trace_dump_g(const Arguments& /*args*/) {
+	return TraceToArray();
+}
 
-	if (!EasyHandle::IsInstanceOf(args[0])) {
-		return TypeError("Argument #1 must be a node-curl handle.");
+Handle<Value> curl_share_init_g(const Arguments& /*args*/) {
+	return ShareHandle::New();
+}
+
+Handle<Value> curl_share_setopt_g(const Arguments& args) {
+	if (!ShareHandle::IsInstanceOf(args[0])) {
+		return TypeError("Argument #1 must be a node-curl share handle.");
 	}
-	EasyHandle* ch = EasyHandle::Unwrap(args[0]);
+	ShareHandle* sh = ShareHandle::Unwrap(args[0]);
 
 	if (!args[1]->IsInt32()) {
-		return TypeError("Argument #2 must be a CURL_* constant.");
+		return TypeError("Argument #2 must be a CURLSHOPT_* constant.");
 	}
-	const CURLoption option = (CURLoption) args[1]->Int32Value();
+	const CURLSHoption option = (CURLSHoption) args[1]->Int32Value();
+
+	CURLSHcode status;
 
 	switch (option) {
-	case CURLOPT_URL:
-		if (args[2]->IsString()) {
-			String::Utf8Value s(args[2]);
-			status = curl_easy_setopt(*ch, option, *s);
-		}
-		else {
-			return TypeError("Argument #3 must be a string.");
-		}
-		break;
-
-	case CURLOPT_ADDRESS_SCOPE:
-	case CURLOPT_APPEND:
-	case CURLOPT_AUTOREFERER:
-	case CURLOPT_BUFFERSIZE:
-	case CURLOPT_CERTINFO:
-	case CURLOPT_CLOSEPOLICY:
-	case CURLOPT_CONNECT_ONLY:
-	case CURLOPT_CONNECTTIMEOUT:
-	case CURLOPT_CONNECTTIMEOUT_MS:
-	case CURLOPT_COOKIESESSION:
-	case CURLOPT_CRLF:
-	case CURLOPT_DIRLISTONLY:
-	case CURLOPT_DNS_CACHE_TIMEOUT:
-	case CURLOPT_DNS_USE_GLOBAL_CACHE:
-	case CURLOPT_FAILONERROR:
-	case CURLOPT_FILETIME:
-	case CURLOPT_FOLLOWLOCATION:
-	case CURLOPT_FORBID_REUSE:
-	case CURLOPT_FRESH_CONNECT:
-	case CURLOPT_FTP_CREATE_MISSING_DIRS:
-	case CURLOPT_FTP_FILEMETHOD:
-	case CURLOPT_FTP_RESPONSE_TIMEOUT:
-	case CURLOPT_FTP_SKIP_PASV_IP:
-	case CURLOPT_FTPSSLAUTH:
-	case CURLOPT_FTP_SSL_CCC:
-	case CURLOPT_FTP_USE_EPRT:
-	case CURLOPT_FTP_USE_EPSV:
-//	case CURLOPT_FTP_USE_PRET:
-	case CURLOPT_HEADER:
-	case CURLOPT_HTTPAUTH:
-	case CURLOPT_HTTP_CONTENT_DECODING:
-	case CURLOPT_HTTPGET:
-	case CURLOPT_HTTPPROXYTUNNEL:
-	case CURLOPT_HTTP_TRANSFER_DECODING:
-	case CURLOPT_HTTP_VERSION:
-	case CURLOPT_IGNORE_CONTENT_LENGTH:
-	case CURLOPT_INFILESIZE:
-	case CURLOPT_IPRESOLVE:
-	case CURLOPT_LOCALPORT:
-	case CURLOPT_LOCALPORTRANGE:
-	case CURLOPT_LOW_SPEED_LIMIT:
-	case CURLOPT_LOW_SPEED_TIME:
-	case CURLOPT_MAXCONNECTS:
-	case CURLOPT_MAXFILESIZE:
-	case CURLOPT_MAXREDIRS:
-	case CURLOPT_NETRC:
-	case CURLOPT_NEW_DIRECTORY_PERMS:
-	case CURLOPT_NEW_FILE_PERMS:
-	case CURLOPT_NOBODY:
-	case CURLOPT_NOPROGRESS:
-	case CURLOPT_NOSIGNAL:
-	case CURLOPT_PORT:
-	case CURLOPT_POST:
-	case CURLOPT_POSTFIELDSIZE:
-	case CURLOPT_POSTREDIR:
-	case CURLOPT_PROTOCOLS:
-	case CURLOPT_PROXYAUTH:
-	case CURLOPT_PROXYPORT:
-	case CURLOPT_PROXY_TRANSFER_MODE:
-	case CURLOPT_PROXYTYPE:
-	case CURLOPT_PUT:
-	case CURLOPT_REDIR_PROTOCOLS:
-	case CURLOPT_RESUME_FROM:
-//	case CURLOPT_RTSP_CLIENT_CSEQ:
-//	case CURLOPT_RTSP_REQUEST:
-//	case CURLOPT_RTSP_SERVER_CSEQ:
-	case CURLOPT_SOCKS5_GSSAPI_NEC:
-	case CURLOPT_SSH_AUTH_TYPES:
-	case CURLOPT_SSLENGINE_DEFAULT:
-	case CURLOPT_SSL_SESSIONID_CACHE:
-	case CURLOPT_SSL_VERIFYHOST:
-	case CURLOPT_SSL_VERIFYPEER:
-	case CURLOPT_SSLVERSION:
-	case CURLOPT_TCP_NODELAY:
-	case CURLOPT_TFTP_BLKSIZE:
-	case CURLOPT_TIMECONDITION:
-	case CURLOPT_TIMEOUT:
-	case CURLOPT_TIMEOUT_MS:
-	case CURLOPT_TIMEVALUE:
-//	case CURLOPT_TRANSFER_ENCODING:
-	case CURLOPT_TRANSFERTEXT:
-	case CURLOPT_UNRESTRICTED_AUTH:
-	case CURLOPT_UPLOAD:
-	case CURLOPT_USE_SSL:
-	case CURLOPT_VERBOSE:
-//	case CURLOPT_WILDCARDMATCH:
-		if (args[2]->IsInt32()) { // special-case booleans? think CURLOPT_VERBOSE
+	case CURLSHOPT_SHARE:
+	case CURLSHOPT_UNSHARE:
+		if (args[2]->IsInt32()) {
 			const long val = args[2]->Int32Value();
-			status = curl_easy_setopt(*ch, option, val);
-		}
-		else {
-			return TypeError("Argument #3 must be an integer.");
-		}
-		break;
-
-	case CURLOPT_WRITEFUNCTION:
-		if (args[2]->IsFunction()) {
-			ch->SetWriteCallback(args[2]);
-			curl_easy_setopt(*ch, CURLOPT_WRITEFUNCTION, WriteFunction);
-			curl_easy_setopt(*ch, CURLOPT_WRITEDATA, ch);
+			status = curl_share_setopt(*sh, option, val);
 		}
 		else {
-			return TypeError("Argument #3 must be a function.");
+			return TypeError("Argument #3 must be a CURL_LOCK_DATA_* constant.");
 		}
 		break;
 
 	default:
-		return TypeError("Argument #3 must be a CURLOPT_* constant.");
+		return TypeError("Argument #2 must be a CURLSHOPT_* constant.");
 	}
 
-	if (status != CURLE_OK) {
-		// TODO throw a {code, message} exception
+	if (status != CURLSHE_OK) {
 		return CurlError(status);
 	}
 
 	return Undefined();
 }
 
-unsigned SListSize(const curl_slist* slist) {
-	unsigned entries = 0;
-
-	for (; slist != NULL; ++entries, slist = slist->next);
-
-	return entries;
-}
-
-Handle<Array> SListToArray(const curl_slist* slist) {
-	Local<Array> array = Array::New(SListSize(slist));
-
-	for (unsigned i = 0; slist != NULL; ++i, slist = slist->next) {
-		array->Set(i, String::New(slist->data));
+Handle<Value> curl_easy_perform_g(const Arguments& args) {
+	if (!EasyHandle::IsInstanceOf(args[0])) {
+		return TypeError("Argument #1 must be a node-curl handle.");
 	}
 
-	return array;
-}
-
-Handle<Array> CertInfoToArray(const struct curl_certinfo* certinfo) {
-	Local<Array> array = Array::New(certinfo->num_of_certs);
+	EasyHandle* ch = EasyHandle::Unwrap(args[0]);
 
-	for (int i = 0; i < certinfo->num_of_certs; ++i) {
-		array->Set(i, SListToArray(certinfo->certinfo[i]));
+	if (!args[1]->IsUndefined() && !args[1]->IsFunction()) {
+		return TypeError("Argument #2 must be a function.");
+	}
+	// before the callback is replaced, it belongs to the running transfer
+	if (ch->IsInFlight()) {
+		return Error("The handle is already in use.");
+	}
+	MultiHandle* mh = &MultiHandle::Singleton();
+	if (WorkerPool::IsInstanceOf(args[2])) {
+		ch->SetCompleteCallback(args[1]);
+		ch->PrepareTransfer();
+		return WorkerPool::Unwrap(args[2])->Add(*ch);
+	}
+	else if (MultiHandle::IsInstanceOf(args[2])) {
+		mh = MultiHandle::Unwrap(args[2]);
+	}
+	else if (!args[2]->IsUndefined()) {
+		return TypeError("Argument #3 must be a node-curl multi handle or worker pool.");
 	}
 
-	return array;
+	ch->SetCompleteCallback(args[1]);
+	ch->PrepareTransfer();
+
+	return mh->Add(*ch);
 }
 
-Handle<Value> curl_easy_getinfo_g(const Arguments& args) {
-	if (!EasyHandle::IsInstanceOf(args[0])) {
-		return TypeError("Argument #1 must be a node-curl handle.");
+// curl_easy_download(url, path, segments, callback[, options[, multi]]) fetches
+// `url` into `path` with up to `segments` ranged transfers in parallel, 64 at
+// most; `options` is a flat [option, value, ...] array that's set on each of
+// them, the callback gets a null or Error argument and the number of bytes
+// written
+Handle<Value> curl_easy_download_g(const Arguments& args) {
+	if (!args[0]->IsString()) {
+		return TypeError("Argument #1 must be a URL.");
+	}
+	if (!args[1]->IsString()) {
+		return TypeError("Argument #2 must be a path.");
+	}
+	if (!args[2]->IsInt32() || args[2]->Int32Value() <= 0) {
+		return TypeError("Argument #3 must be a positive integer.");
+	}
+	if (!args[3]->IsFunction()) {
+		return TypeError("Argument #4 must be a function.");
 	}
-	EasyHandle* ch = EasyHandle::Unwrap(args[0]);
 
-	if (!args[1]->IsInt32()) {
-		return TypeError("Argument #2 must be a CURLINFO_* constant.");
+	Local<Array> options = Array::New();
+	if (args[4]->IsArray()) {
+		options = Local<Array>::Cast(args[4]);
+		if (options->Length() % 2 != 0) {
+			return TypeError("Argument #5 must hold option/value pairs.");
+		}
+		for (uint32_t i = 0; i < options->Length(); i += 2) {
+			if (!options->Get(i)->IsInt32()) {
+				return TypeError("Argument #5 must hold CURLOPT_* constants.");
+			}
+		}
+	}
+	else if (!args[4]->IsUndefined() && !args[4]->IsNull()) {
+		return TypeError("Argument #5 must be an array.");
 	}
-	const CURLINFO option = (CURLINFO) args[1]->Int32Value();
 
-	union {
-		const struct curl_certinfo* certinfo_;
-		const curl_slist* slist_;
-		const char* string_;
-		double double_;
-		long long_;
-	} value;
+	MultiHandle* mh = &MultiHandle::Singleton();
+	if (MultiHandle::IsInstanceOf(args[5])) {
+		mh = MultiHandle::Unwrap(args[5]);
+	}
+	else if (!args[5]->IsUndefined()) {
+		return TypeError("Argument #6 must be a node-curl multi handle.");
+	}
 
-	CURLcode status = curl_easy_getinfo(*ch, option, &value);
-	if (status != CURLE_OK) {
-		return CurlError(status);
+	String::Utf8Value path(args[1]);
+	const int fd = open(*path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		return Error(strerror(errno));
 	}
 
-	Handle<Value> rv;
+	return Download::Start(args[0], fd, args[2]->Int32Value(), options, args[3], mh);
+}
 
-	switch (option) {
-	case CURLINFO_CONDITION_UNMET:
-	case CURLINFO_FILETIME:
-	case CURLINFO_HEADER_SIZE:
-	case CURLINFO_HTTPAUTH_AVAIL:
-	case CURLINFO_HTTP_CONNECTCODE:
-	case CURLINFO_LASTSOCKET:
-//	case CURLINFO_LOCAL_PORT:
-	case CURLINFO_NUM_CONNECTS:
-	case CURLINFO_OS_ERRNO:
-//	case CURLINFO_PRIMARY_PORT:
-	case CURLINFO_PROXYAUTH_AVAIL:
-	case CURLINFO_REDIRECT_COUNT:
-	case CURLINFO_REQUEST_SIZE:
-	case CURLINFO_RESPONSE_CODE:
-//	case CURLINFO_RTSP_CLIENT_CSEQ:
-//	case CURLINFO_RTSP_CSEQ_RECV:
-//	case CURLINFO_RTSP_SERVER_CSEQ:
-	case CURLINFO_SSL_VERIFYRESULT:
-		rv = Integer::New(value.long_);
-		break;
+// like curl_easy_perform() but for an array of handles, they share the callback
+// and are added in one go, that saves a sweep over the multi handle per handle
+Handle<Value> curl_easy_perform_many_g(const Arguments& args) {
+	if (!args[0]->IsArray()) {
+		return TypeError("Argument #1 must be an array of node-curl handles.");
+	}
+	Local<Array> array = Local<Array>::Cast(args[0]);
 
-	case CURLINFO_APPCONNECT_TIME:
-	case CURLINFO_CONNECT_TIME:
-	case CURLINFO_CONTENT_LENGTH_DOWNLOAD:
-	case CURLINFO_CONTENT_LENGTH_UPLOAD:
-	case CURLINFO_NAMELOOKUP_TIME:
-	case CURLINFO_PRETRANSFER_TIME:
-	case CURLINFO_REDIRECT_TIME:
-	case CURLINFO_SIZE_DOWNLOAD:
-	case CURLINFO_SIZE_UPLOAD:
-	case CURLINFO_SPEED_DOWNLOAD:
-	case CURLINFO_SPEED_UPLOAD:
-	case CURLINFO_STARTTRANSFER_TIME:
-	case CURLINFO_TOTAL_TIME:
-		rv = Number::New(value.double_);
-		break;
+	EasyHandles handles;
+	handles.reserve(array->Length());
 
-	case CURLINFO_CONTENT_TYPE:
-	case CURLINFO_EFFECTIVE_URL:
-	case CURLINFO_FTP_ENTRY_PATH:
-//	case CURLINFO_LOCAL_IP:
-	case CURLINFO_PRIMARY_IP:
-	case CURLINFO_PRIVATE:
-	case CURLINFO_REDIRECT_URL:
-//	case CURLINFO_RTSP_SESSION_ID:
-		if (value.string_) {
-			rv = String::New(value.string_);
-		}
-		else {
-			rv = String::Empty();
+	for (uint32_t i = 0; i < array->Length(); ++i) {
+		Local<Value> handle = array->Get(i);
+		if (!EasyHandle::IsInstanceOf(handle)) {
+			return TypeError("Argument #1 must be an array of node-curl handles.");
 		}
-		break;
+		handles.push_back(EasyHandle::Unwrap(handle));
+	}
 
-	case CURLINFO_COOKIELIST:
-	case CURLINFO_SSL_ENGINES:
-		rv = SListToArray(value.slist_);
-		break;
+	if (!args[1]->IsUndefined() && !args[1]->IsFunction()) {
+		return TypeError("Argument #2 must be a function.");
+	}
 
-	case CURLINFO_CERTINFO:
-		rv = CertInfoToArray(value.certinfo_);
-		break;
+	bool use_pool = false;
+	if (WorkerPool::IsInstanceOf(args[2])) {
+		use_pool = true;
+	}
+	else if (!args[2]->IsUndefined() && !MultiHandle::IsInstanceOf(args[2])) {
+		return TypeError("Argument #3 must be a node-curl multi handle or worker pool.");
+	}
 
-	default:
-		return TypeError("Argument #2 must be a CURLINFO_* constant.");
+	for (EasyHandles::iterator it = handles.begin(); it != handles.end(); ++it) {
+		if ((*it)->IsInFlight()) {
+			return Error("The handle is already in use.");
+		}
+	}
+	if (HasDuplicates(handles)) {
+		return Error("The same handle can't be added twice.");
 	}
 
-	return rv;
-}
+	for (EasyHandles::iterator it = handles.begin(); it != handles.end(); ++it) {
+		(*it)->SetCompleteCallback(args[1]);
+		(*it)->PrepareTransfer();
+	}
 
-Handle<Value> curl_easy_perform_g(const Arguments& args) {
-	if (!EasyHandle::IsInstanceOf(args[0])) {
-		return TypeError("Argument #1 must be a node-curl handle.");
+	if (use_pool) {
+		return WorkerPool::Unwrap(args[2])->AddMany(handles);
 	}
 
-	EasyHandle* ch = EasyHandle::Unwrap(args[0]);
-	return MultiHandle::Singleton().Add(*ch);
+	MultiHandle* mh = &MultiHandle::Singleton();
+	if (!args[2]->IsUndefined()) {
+		mh = MultiHandle::Unwrap(args[2]);
+	}
+
+	return mh->AddMany(handles);
 }
 
 void RegisterModule(Handle<Object> target) {
 	easyHandleTemplate = Persistent<ObjectTemplate>::New(ObjectTemplate::New());
 	easyHandleTemplate->SetInternalFieldCount(2);
 
+	shareHandleTemplate = Persistent<ObjectTemplate>::New(ObjectTemplate::New());
+	shareHandleTemplate->SetInternalFieldCount(2);
+
+	multiHandleTemplate = Persistent<ObjectTemplate>::New(ObjectTemplate::New());
+	multiHandleTemplate->SetInternalFieldCount(2);
+
+	workerPoolTemplate = Persistent<ObjectTemplate>::New(ObjectTemplate::New());
+	workerPoolTemplate->SetInternalFieldCount(2);
+
+	headersTemplate = Persistent<ObjectTemplate>::New(ObjectTemplate::New());
+	headersTemplate->SetInternalFieldCount(1);
+	headersTemplate->SetNamedPropertyHandler(Headers::Getter, 0, Headers::Query, 0, Headers::Enumerator);
+
 	CURLcode status = curl_global_init(CURL_GLOBAL_ALL);
 	if (status != CURLE_OK) {
 		CurlError(status); // raises an exception
@@ -630,6 +5266,8 @@ void RegisterModule(Handle<Object> target) {
 	}
 	atexit(curl_global_cleanup);
 
+	SortOptionTable();
+
 	if (!MultiHandle::Initialize()) {
 		Error("curl_multi_init() returned NULL!");
 		return;
@@ -641,15 +5279,82 @@ void RegisterModule(Handle<Object> target) {
 	target->Set(
 		String::NewSymbol("curl_easy_setopt"),
 		FunctionTemplate::New(curl_easy_setopt_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_easy_setopt_array"),
+		FunctionTemplate::New(curl_easy_setopt_array_g)->GetFunction());
 	target->Set(
 		String::NewSymbol("curl_easy_perform"),
 		FunctionTemplate::New(curl_easy_perform_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_easy_perform_many"),
+		FunctionTemplate::New(curl_easy_perform_many_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_easy_download"),
+		FunctionTemplate::New(curl_easy_download_g)->GetFunction());
 	target->Set(
 		String::NewSymbol("curl_easy_getinfo"),
 		FunctionTemplate::New(curl_easy_getinfo_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_easy_getmetrics"),
+		FunctionTemplate::New(curl_easy_getmetrics_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_easy_upload"),
+		FunctionTemplate::New(curl_easy_upload_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_easy_pause"),
+		FunctionTemplate::New(curl_easy_pause_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_easy_reset"),
+		FunctionTemplate::New(curl_easy_reset_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_easy_cleanup"),
+		FunctionTemplate::New(curl_easy_cleanup_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_easy_close"),
+		FunctionTemplate::New(curl_easy_cleanup_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_easy_setpoolsize"),
+		FunctionTemplate::New(curl_easy_setpoolsize_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_multi_init"),
+		FunctionTemplate::New(curl_multi_init_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_multi_setopt"),
+		FunctionTemplate::New(curl_multi_setopt_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_multi_stats"),
+		FunctionTemplate::New(curl_multi_stats_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_version_info"),
+		FunctionTemplate::New(curl_version_info_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_progress_init"),
+		FunctionTemplate::New(curl_progress_init_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_dns_prefetch"),
+		FunctionTemplate::New(curl_dns_prefetch_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_dns_setttl"),
+		FunctionTemplate::New(curl_dns_setttl_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_workers_init"),
+		FunctionTemplate::New(curl_workers_init_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_trace_dump"),
+		FunctionTemplate::New(curl_trace_dump_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_share_init"),
+		FunctionTemplate::New(curl_share_init_g)->GetFunction());
+	target->Set(
+		String::NewSymbol("curl_share_setopt"),
+		FunctionTemplate::New(curl_share_setopt_g)->GetFunction());
 
 #define EXPORT(symbol) target->Set(String::NewSymbol(#symbol), Integer::New(symbol))
-//	EXPORT(CURLOPT_ACCEPT_ENCODING);
+#if LIBCURL_VERSION_NUM >= 0x071506
+	EXPORT(CURLOPT_ACCEPT_ENCODING);
+#else
+	target->Set(String::NewSymbol("CURLOPT_ACCEPT_ENCODING"), Integer::New(CURLOPT_ENCODING));
+#endif
 	EXPORT(CURLOPT_ADDRESS_SCOPE);
 	EXPORT(CURLOPT_APPEND);
 	EXPORT(CURLOPT_AUTOREFERER);
@@ -777,7 +5482,12 @@ void RegisterModule(Handle<Object> target) {
 	EXPORT(CURLOPT_READFUNCTION);
 	EXPORT(CURLOPT_REDIR_PROTOCOLS);
 	EXPORT(CURLOPT_REFERER);
-//	EXPORT(CURLOPT_RESOLVE);
+#if LIBCURL_VERSION_NUM >= 0x071503
+	EXPORT(CURLOPT_RESOLVE);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x073100
+	EXPORT(CURLOPT_CONNECT_TO);
+#endif
 	EXPORT(CURLOPT_RESUME_FROM);
 	EXPORT(CURLOPT_RESUME_FROM_LARGE);
 //	EXPORT(CURLOPT_RTSP_CLIENT_CSEQ);
@@ -824,7 +5534,9 @@ void RegisterModule(Handle<Object> target) {
 //	EXPORT(CURLOPT_TLSAUTH_PASSWORD);
 //	EXPORT(CURLOPT_TLSAUTH_TYPE);
 //	EXPORT(CURLOPT_TLSAUTH_USERNAME);
-//	EXPORT(CURLOPT_TRANSFER_ENCODING);
+#if LIBCURL_VERSION_NUM >= 0x071506
+	EXPORT(CURLOPT_TRANSFER_ENCODING);
+#endif
 	EXPORT(CURLOPT_TRANSFERTEXT);
 	EXPORT(CURLOPT_UNRESTRICTED_AUTH);
 	EXPORT(CURLOPT_UPLOAD);
@@ -869,7 +5581,6 @@ void RegisterModule(Handle<Object> target) {
 	EXPORT(CURLINFO_PRETRANSFER_TIME);
 	EXPORT(CURLINFO_PRIMARY_IP);
 //	EXPORT(CURLINFO_PRIMARY_PORT);
-	EXPORT(CURLINFO_PRIVATE);
 	EXPORT(CURLINFO_PROXYAUTH_AVAIL);
 	EXPORT(CURLINFO_REDIRECT_COUNT);
 	EXPORT(CURLINFO_REDIRECT_TIME);
@@ -891,6 +5602,101 @@ void RegisterModule(Handle<Object> target) {
 	EXPORT(CURLINFO_STARTTRANSFER_TIME);
 //	EXPORT(CURLINFO_TEXT);
 	EXPORT(CURLINFO_TOTAL_TIME);
+
+	EXPORT(CURLPAUSE_RECV);
+	EXPORT(CURLPAUSE_SEND);
+	EXPORT(CURLPAUSE_ALL);
+	EXPORT(CURLPAUSE_CONT);
+	EXPORT(CURL_WRITEFUNC_PAUSE);
+
+	EXPORT(CURLMOPT_MAXCONNECTS);
+	EXPORT(CURLMOPT_PIPELINING);
+#if LIBCURL_VERSION_NUM >= 0x071e00
+	EXPORT(CURLMOPT_MAX_HOST_CONNECTIONS);
+	EXPORT(CURLMOPT_MAX_TOTAL_CONNECTIONS);
+#endif
+
+	EXPORT(CURL_HTTP_VERSION_NONE);
+	EXPORT(CURL_HTTP_VERSION_1_0);
+	EXPORT(CURL_HTTP_VERSION_1_1);
+#if LIBCURL_VERSION_NUM >= 0x072100
+	EXPORT(CURL_HTTP_VERSION_2_0);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072f00
+	EXPORT(CURL_HTTP_VERSION_2TLS);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x073100
+	EXPORT(CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+#endif
+
+#if LIBCURL_VERSION_NUM >= 0x072b00
+	EXPORT(CURLPIPE_NOTHING);
+	EXPORT(CURLPIPE_HTTP1);
+	EXPORT(CURLPIPE_MULTIPLEX);
+	EXPORT(CURLOPT_PIPEWAIT);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072e00
+	EXPORT(CURLOPT_STREAM_WEIGHT);
+	EXPORT(CURLOPT_STREAM_DEPENDS);
+	EXPORT(CURLOPT_STREAM_DEPENDS_E);
+#endif
+
+	EXPORT(CURL_VERSION_IPV6);
+	EXPORT(CURL_VERSION_SSL);
+	EXPORT(CURL_VERSION_LIBZ);
+#if LIBCURL_VERSION_NUM >= 0x072100
+	EXPORT(CURL_VERSION_HTTP2);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x073900
+	EXPORT(CURL_VERSION_BROTLI);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x074800
+	EXPORT(CURL_VERSION_ZSTD);
+#endif
+
+	EXPORT(CURLSHOPT_SHARE);
+	EXPORT(CURLSHOPT_UNSHARE);
+
+	EXPORT(CURL_LOCK_DATA_COOKIE);
+	EXPORT(CURL_LOCK_DATA_DNS);
+	EXPORT(CURL_LOCK_DATA_SSL_SESSION);
+
+	EXPORT(NODECURLOPT_WRITEBUFFER);
+	EXPORT(NODECURLOPT_WRITE_HIGHWATERMARK);
+	EXPORT(NODECURLOPT_WRITE_MAXDELAY);
+	EXPORT(NODECURLOPT_ACCUMULATE);
+	EXPORT(NODECURLOPT_UPLOADSTREAM);
+	EXPORT(NODECURLOPT_WRITEFILE);
+	EXPORT(NODECURLOPT_WRITEFILE_OFFSET);
+	EXPORT(NODECURLOPT_HEADERS);
+	EXPORT(NODECURLOPT_PRIORITY);
+	EXPORT(NODECURLOPT_DNS_CACHE);
+	EXPORT(NODECURLOPT_PROGRESS);
+	EXPORT(NODECURLOPT_AUTOCLOSE);
+	EXPORT(NODECURLMOPT_MAX_INFLIGHT);
+	EXPORT(NODECURLMOPT_MAX_HOST_INFLIGHT);
+	EXPORT(NODECURLMOPT_HOST_RATE);
+	EXPORT(NODECURLMOPT_HOST_BURST);
+	EXPORT(NODECURLMOPT_PRIORITY_WEIGHTS);
+	target->Set(String::NewSymbol("NODECURL_PRIORITY_LEVELS"), Integer::New(PRIORITY_LEVELS));
+
+	EXPORT(CURLMETRIC_NAMELOOKUP_TIME);
+	EXPORT(CURLMETRIC_CONNECT_TIME);
+	EXPORT(CURLMETRIC_APPCONNECT_TIME);
+	EXPORT(CURLMETRIC_PRETRANSFER_TIME);
+	EXPORT(CURLMETRIC_STARTTRANSFER_TIME);
+	EXPORT(CURLMETRIC_TOTAL_TIME);
+	EXPORT(CURLMETRIC_REDIRECT_TIME);
+	EXPORT(CURLMETRIC_REDIRECT_COUNT);
+	EXPORT(CURLMETRIC_RESPONSE_CODE);
+	EXPORT(CURLMETRIC_HEADER_SIZE);
+	EXPORT(CURLMETRIC_REQUEST_SIZE);
+	EXPORT(CURLMETRIC_SIZE_UPLOAD);
+	EXPORT(CURLMETRIC_SIZE_DOWNLOAD);
+	EXPORT(CURLMETRIC_SPEED_UPLOAD);
+	EXPORT(CURLMETRIC_SPEED_DOWNLOAD);
+	EXPORT(CURLMETRIC_CONTENT_LENGTH_DOWNLOAD);
+	EXPORT(CURLMETRIC_COUNT);
 #undef EXPORT
 }
 
@@ -0,0 +1,137 @@
+// HTTP server the tests run against, `require('./server').listen(port, cb)`
+// starts it on 127.0.0.1 and returns the http.Server:
+//
+// /small     a short JSON body
+// /headers   an empty body with a few headers to capture
+// /echo      the request body, sent back once it's all in
+// /chunks/N  N writes of 16 bytes each, chunked
+// /object/N  N bytes where byte i is i & 0xff, honours Range; /object/N?mode
+//            misbehaves: `norange` ignores Range, `unknown` sends a "*" total,
+//            `flaky` fails each range with a 500 the first time, `fail` sends
+//            a 404 for ranges past the first byte, `wrongstart` answers with
+//            the range shifted by one
+//
+// Anything else is a 404.
+
+var http = require('http');
+
+var small = new Buffer('{"ok":true,"id":12345,"name":"node-curl"}');
+var block = new Buffer(64 * 1024);
+for (var i = 0; i < block.length; ++i) {
+	block[i] = i & 0xff;
+}
+var chunk = new Buffer('0123456789abcdef');
+var errorPage = new Buffer(8 * 1024);
+for (var i = 0; i < errorPage.length; ++i) {
+	errorPage[i] = 0x58; // 'X', longer than a small segment
+}
+var flaky = {};
+
+exports.small = small;
+
+function serve(req, res) {
+	var m;
+
+	if (req.url == '/small') {
+		res.writeHead(200, { 'Content-Type': 'application/json', 'Content-Length': small.length });
+		res.end(small);
+	}
+	else if (req.url == '/headers') {
+		res.writeHead(200, {
+			'Content-Type': 'text/plain',
+			'Content-Length': 0,
+			'X-Node-Curl': '  padded  '
+		});
+		res.end();
+	}
+	else if (req.url == '/echo') {
+		var parts = [], length = 0;
+		req.on('data', function(data) {
+			parts.push(data);
+			length += data.length;
+		});
+		req.on('end', function() {
+			var body = new Buffer(length), pos = 0;
+			parts.forEach(function(part) {
+				part.copy(body, pos, 0, part.length);
+				pos += part.length;
+			});
+			res.writeHead(200, { 'Content-Type': 'application/octet-stream', 'Content-Length': length });
+			res.end(body);
+		});
+	}
+	else if ((m = /^\/chunks\/(\d+)$/.exec(req.url))) {
+		var count = parseInt(m[1], 10);
+		res.writeHead(200, { 'Content-Type': 'text/plain' });
+		(function write() {
+			while (count-- > 0) {
+				if (!res.write(chunk)) {
+					res.once('drain', write);
+					return;
+				}
+			}
+			res.end();
+		})();
+	}
+	else if ((m = /^\/object\/(\d+)(?:\?(\w+))?$/.exec(req.url))) {
+		object(req, res, parseInt(m[1], 10), m[2] || '');
+	}
+	else {
+		res.writeHead(404);
+		res.end();
+	}
+}
+
+function object(req, res, size, mode) {
+	var range = /^bytes=(\d+)-(\d*)$/.exec(req.headers.range || '');
+	if (!range || mode == 'norange') {
+		pattern(res, 200, { 'Content-Length': size }, 0, size);
+		return;
+	}
+
+	var first = parseInt(range[1], 10);
+	var last = range[2] ? Math.min(parseInt(range[2], 10), size - 1) : size - 1;
+
+	if (first >= size) {
+		res.writeHead(416, { 'Content-Range': 'bytes */' + size, 'Content-Length': errorPage.length });
+		res.end(errorPage);
+	}
+	else if ((mode == 'flaky' && !flaky[req.url + req.headers.range]) || (mode == 'fail' && first > 1)) {
+		flaky[req.url + req.headers.range] = true;
+		res.writeHead(mode == 'fail' ? 404 : 500, { 'Content-Length': errorPage.length });
+		res.end(errorPage);
+	}
+	else {
+		var start = mode == 'wrongstart' ? first + 1 : first;
+		var total = mode == 'unknown' ? '*' : size;
+		pattern(res, 206, {
+			'Content-Range': 'bytes ' + start + '-' + last + '/' + total,
+			'Content-Length': last - first + 1
+		}, first, last - first + 1);
+	}
+}
+
+// `left` bytes of the /object pattern from `pos` on
+function pattern(res, status, headers, pos, left) {
+	headers['Content-Type'] = 'application/octet-stream';
+	res.writeHead(status, headers);
+	(function write() {
+		while (left > 0) {
+			var n = Math.min(left, block.length - 256);
+			var offset = pos & 0xff;
+			left -= n;
+			pos += n;
+			if (!res.write(block.slice(offset, offset + n))) {
+				res.once('drain', write);
+				return;
+			}
+		}
+		res.end();
+	})();
+}
+
+exports.listen = function(port, callback) {
+	var server = http.createServer(serve);
+	server.listen(port, '127.0.0.1', callback);
+	return server;
+};
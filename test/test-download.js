@@ -0,0 +1,143 @@
+// Behaviour of curl_easy_download() against the test server's /object routes,
+// run with `node test/test-download.js` after a build. Exits non-zero on the
+// first failed check.
+
+var assert = require('assert');
+var fs = require('fs');
+var curl = require('../build/default/curl');
+
+// import symbols into the global namespace
+for (var k in curl) {
+	global[k] = curl[k];
+}
+
+var port = 4343;
+var base = 'http://127.0.0.1:' + port;
+var size = 3 * 1024 * 1024 + 17; // doesn't split evenly
+
+function path(name) {
+	return '/tmp/node-curl-download-' + process.pid + '-' + name;
+}
+
+// the file holds the /object pattern, byte i is i & 0xff
+function checkFile(file, length) {
+	var data = fs.readFileSync(file);
+	assert.equal(data.length, length);
+	for (var i = 0; i < data.length; ++i) {
+		if (data[i] != (i & 0xff)) {
+			assert.fail(data[i], i & 0xff, 'wrong byte at ' + i, '==');
+		}
+	}
+}
+
+// `check` gets the callback's arguments, the callback must run exactly once
+// and never before curl_easy_download() returns
+function download(name, url, segments, check) {
+	return function(next) {
+		var file = path(name);
+		var calls = 0;
+		var returned = false;
+
+		curl_easy_download(url, file, segments, function(ex, bytes) {
+			assert.ok(returned, name + ': called back synchronously');
+			assert.equal(++calls, 1, name + ': called back more than once');
+			check(ex, bytes, file);
+			try {
+				fs.unlinkSync(file);
+			}
+			catch (e) {
+			}
+			console.log('ok ' + name);
+			// give a second callback the chance to show up
+			setTimeout(next, 50);
+		});
+		returned = true;
+	};
+}
+
+var tests = [
+	download('split', base + '/object/' + size, 4, function(ex, bytes, file) {
+		assert.equal(ex, null);
+		assert.equal(bytes, size);
+		checkFile(file, size);
+	}),
+
+	download('many segments', base + '/object/' + size, 1000000, function(ex, bytes, file) {
+		assert.equal(ex, null);
+		assert.equal(bytes, size);
+		checkFile(file, size);
+	}),
+
+	download('no range support', base + '/object/' + size + '?norange', 4, function(ex, bytes, file) {
+		assert.equal(ex, null);
+		assert.equal(bytes, size);
+		checkFile(file, size);
+	}),
+
+	download('unknown size', base + '/object/' + size + '?unknown', 4, function(ex, bytes, file) {
+		assert.equal(ex, null);
+		assert.equal(bytes, size);
+		checkFile(file, size);
+	}),
+
+	download('empty object', base + '/object/0', 4, function(ex, bytes, file) {
+		assert.equal(ex, null);
+		assert.equal(bytes, 0);
+		checkFile(file, 0);
+	}),
+
+	download('tiny object', base + '/object/3', 8, function(ex, bytes, file) {
+		assert.equal(ex, null);
+		assert.equal(bytes, 3);
+		checkFile(file, 3);
+	}),
+
+	download('retried segments', base + '/object/' + size + '?flaky', 4, function(ex, bytes, file) {
+		assert.equal(ex, null);
+		assert.equal(bytes, size);
+		checkFile(file, size);
+	}),
+
+	download('failed segment', base + '/object/' + size + '?fail', 4, function(ex) {
+		assert.ok(ex instanceof Error);
+		assert.ok(/404/.test(ex.message), ex.message);
+	}),
+
+	download('misplaced range', base + '/object/' + size + '?wrongstart', 4, function(ex) {
+		assert.ok(ex instanceof Error);
+	}),
+
+	download('not found', base + '/nothing', 4, function(ex) {
+		assert.ok(ex instanceof Error);
+		assert.ok(/404/.test(ex.message), ex.message);
+	}),
+
+	// fails inside curl_multi_socket_action(), right as the probe is added
+	download('immediate failure', 'nosuchprotocol://127.0.0.1/', 4, function(ex, bytes) {
+		assert.ok(ex instanceof Error);
+		assert.equal(bytes, 0);
+	}),
+
+	function(next) {
+		assert.throws(function() {
+			curl_easy_download(base + '/object/1', path('bad'), 0, function() {});
+		}, TypeError);
+		assert.throws(function() {
+			curl_easy_download(base + '/object/1', path('bad'), 1, function() {}, [CURLOPT_VERBOSE]);
+		}, TypeError);
+		console.log('ok arguments');
+		next();
+	}
+];
+
+var server = require('./server').listen(port, function() {
+	(function next() {
+		var test = tests.shift();
+		if (test) {
+			test(next);
+		}
+		else {
+			server.close();
+		}
+	})();
+});
@@ -0,0 +1,242 @@
+// One quick pass over each of the bindings' features against the test server,
+// run with `node test/test-smoke.js` after a build. Exits non-zero on the
+// first failed check.
+
+var assert = require('assert');
+var fs = require('fs');
+var curl = require('../build/default/curl');
+var fixture = require('./server');
+
+// import symbols into the global namespace
+for (var k in curl) {
+	global[k] = curl[k];
+}
+
+var port = 4344;
+var base = 'http://127.0.0.1:' + port;
+
+function path(name) {
+	return '/tmp/node-curl-smoke-' + process.pid + '-' + name;
+}
+
+function equal(a, b) {
+	return a.length == b.length && a.toString('binary') == b.toString('binary');
+}
+
+// a handle that fetches `url` and hands the body back when it's done
+function fetcher(url) {
+	var ch = curl_easy_init();
+	curl_easy_setopt(ch, CURLOPT_URL, url);
+	curl_easy_setopt(ch, NODECURLOPT_ACCUMULATE, 1);
+	return ch;
+}
+
+var tests = [
+	function accumulate(next) {
+		var ch = fetcher(base + '/small');
+		curl_easy_perform(ch, function(ex, body) {
+			assert.equal(ex, null);
+			assert.ok(Buffer.isBuffer(body));
+			assert.ok(equal(body, fixture.small));
+			next();
+		});
+	},
+
+	function file(next) {
+		var ch = curl_easy_init();
+		var file = path('file');
+		curl_easy_setopt(ch, CURLOPT_URL, base + '/small');
+		curl_easy_setopt(ch, NODECURLOPT_WRITEFILE, file);
+		curl_easy_perform(ch, function(ex, bytes) {
+			assert.equal(ex, null);
+			assert.equal(bytes, fixture.small.length);
+			assert.ok(equal(fs.readFileSync(file), fixture.small));
+			fs.unlinkSync(file);
+			next();
+		});
+	},
+
+	function headers(next) {
+		var ch = fetcher(base + '/headers');
+		curl_easy_setopt(ch, NODECURLOPT_HEADERS, 1);
+		curl_easy_perform(ch, function(ex, body, headers) {
+			assert.equal(ex, null);
+			assert.equal(headers[':status'], 200);
+			assert.equal(headers['content-type'], 'text/plain');
+			assert.equal(headers['X-Node-Curl'], 'padded');
+			assert.equal(headers['x-missing'], undefined);
+			next();
+		});
+	},
+
+	function setopt_array(next) {
+		var ch = curl_easy_init();
+		assert.throws(function() {
+			curl_easy_setopt_array(ch, [CURLOPT_URL]);
+		}, TypeError);
+		assert.throws(function() {
+			curl_easy_setopt_array(ch, ['url', base + '/small']);
+		}, TypeError);
+		curl_easy_setopt_array(ch, [
+			CURLOPT_URL, base + '/small',
+			NODECURLOPT_ACCUMULATE, 1,
+			CURLOPT_HTTPHEADER, ['Accept: application/json']
+		]);
+		curl_easy_perform(ch, function(ex, body) {
+			assert.equal(ex, null);
+			assert.ok(equal(body, fixture.small));
+			next();
+		});
+	},
+
+	function share(next) {
+		var sh = curl_share_init();
+		curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		var handles = [fetcher(base + '/small'), fetcher(base + '/small')];
+		var left = handles.length;
+		handles.forEach(function(ch) {
+			curl_easy_setopt(ch, CURLOPT_SHARE, sh);
+		});
+		curl_easy_perform_many(handles, function(ex, body) {
+			assert.equal(ex, null);
+			assert.ok(equal(body, fixture.small));
+			if (--left == 0) {
+				// detaches them from the share handle before it can go
+				handles.forEach(curl_easy_cleanup);
+				next();
+			}
+		});
+	},
+
+	function pause(next) {
+		var ch = curl_easy_init();
+		var count = 1000, bytes = 0, paused = false;
+		curl_easy_setopt(ch, CURLOPT_URL, base + '/chunks/' + count);
+		curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, function(buffer, start, end) {
+			if (!paused) {
+				// libcurl hands the same data over again after the resume
+				paused = true;
+				setTimeout(function() {
+					curl_easy_pause(ch, CURLPAUSE_CONT);
+				}, 50);
+				return CURL_WRITEFUNC_PAUSE;
+			}
+			bytes += end - start;
+		});
+		curl_easy_perform(ch, function(ex) {
+			assert.equal(ex, null);
+			assert.ok(paused);
+			assert.equal(bytes, 16 * count);
+			next();
+		});
+	},
+
+	function upload(next) {
+		var ch = fetcher(base + '/echo');
+		var parts = [new Buffer('streamed '), new Buffer('in '), new Buffer('pieces')];
+		assert.throws(function() {
+			curl_easy_upload(ch, parts[0]);
+		}, Error);
+		curl_easy_setopt(ch, CURLOPT_UPLOAD, 1);
+		curl_easy_setopt(ch, NODECURLOPT_UPLOADSTREAM, 1);
+		curl_easy_perform(ch, function(ex, body) {
+			assert.equal(ex, null);
+			assert.equal(body.toString(), 'streamed in pieces');
+			next();
+		});
+		// one part right away, the rest while the transfer waits for them
+		curl_easy_upload(ch, parts.shift());
+		(function push() {
+			setTimeout(function() {
+				var part = parts.shift() || null;
+				curl_easy_upload(ch, part);
+				if (part) {
+					push();
+				}
+			}, 10);
+		})();
+	},
+
+	function workers(next) {
+		var pool = curl_workers_init(2);
+		var handles = [], left = 4;
+		for (var i = 0; i < left; ++i) {
+			handles.push(fetcher(base + '/small'));
+		}
+		var js = fetcher(base + '/small');
+		curl_easy_setopt(js, CURLOPT_WRITEFUNCTION, function() {});
+		assert.throws(function() {
+			curl_easy_perform(js, function() {}, pool);
+		}, Error);
+
+		curl_easy_perform_many(handles, function(ex, body) {
+			assert.equal(ex, null);
+			assert.ok(equal(body, fixture.small));
+			if (--left == 0) {
+				next();
+			}
+		}, pool);
+		assert.throws(function() {
+			curl_easy_setopt(handles[0], CURLOPT_URL, base + '/nothing');
+		}, Error);
+		assert.throws(function() {
+			curl_easy_getinfo(handles[0], CURLINFO_RESPONSE_CODE);
+		}, Error);
+	},
+
+	function scheduler(next) {
+		var mh = curl_multi_init();
+		var handles = [], left = 6;
+		curl_multi_setopt(mh, NODECURLMOPT_MAX_HOST_INFLIGHT, 2);
+		for (var i = 0; i < left; ++i) {
+			handles.push(fetcher(base + '/small'));
+		}
+		curl_easy_setopt(handles[left - 1], NODECURLOPT_PRIORITY, 1);
+
+		curl_easy_perform_many(handles, function(ex, body) {
+			assert.equal(ex, null);
+			assert.ok(equal(body, fixture.small));
+			if (--left == 0) {
+				var stats = curl_multi_stats(mh);
+				assert.equal(stats.handles, 0);
+				assert.equal(stats.pending, 0);
+				assert.equal(stats.transfers, handles.length);
+				next();
+			}
+		}, mh);
+		var stats = curl_multi_stats(mh);
+		assert.equal(stats.handles, handles.length);
+		assert.equal(stats.pending, handles.length - 2);
+	},
+
+	function getmetrics(next) {
+		var ch = fetcher(base + '/small');
+		curl_easy_perform(ch, function(ex) {
+			assert.equal(ex, null);
+			var metrics = curl_easy_getmetrics(ch);
+			assert.equal(metrics.length, CURLMETRIC_COUNT);
+			assert.equal(metrics[CURLMETRIC_RESPONSE_CODE], 200);
+			assert.equal(metrics[CURLMETRIC_SIZE_DOWNLOAD], fixture.small.length);
+			assert.ok(metrics[CURLMETRIC_TOTAL_TIME] >= metrics[CURLMETRIC_STARTTRANSFER_TIME]);
+			var reused = [];
+			assert.strictEqual(curl_easy_getmetrics(ch, reused), reused);
+			assert.equal(reused[CURLMETRIC_RESPONSE_CODE], 200);
+			next();
+		});
+	}
+];
+
+var server = fixture.listen(port, function() {
+	(function next() {
+		var test = tests.shift();
+		if (test) {
+			test(function() {
+				console.log('ok ' + test.name);
+				next();
+			});
+		}
+		else {
+			server.close();
+		}
+	})();
+});